@@ -1,12 +1,15 @@
 /* Implementation of simple command-line interface */
 
+#include <assert.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -20,6 +23,20 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are also indexed by name in tries, for lookups and
+ * completion in time linear in the length of the name. Children of a node
+ * are kept in a list sorted by character, so that walks go in alphabetical
+ * order.
+ */
+typedef struct __trie_node {
+    char c;
+    void *value; /* Element whose name ends here, if any */
+    struct __trie_node *child, *sibling;
+} trie_node_t;
+
+static trie_node_t *cmd_trie = NULL;
+static trie_node_t *param_trie = NULL;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -29,22 +46,39 @@ static bool block_timing = false;
 /* Time of day */
 static double first_time, last_time;
 
-/* Implement buffered I/O using variant of RIO package from CS:APP
- * Must create stack of buffers to handle I/O with nested source commands.
+/* Latency of commands, in HDR histograms: values below LAT_SUB nanoseconds
+ * are counted exactly, then every power of 2 is split into LAT_SUB buckets,
+ * which keeps the relative error below 1 / LAT_SUB.
+ */
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct __latency_hist {
+    uint64_t count, max;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+/* Input files, stacked to handle nested source commands.
+ * Regular files are mapped whole, others are read in large chunks into a
+ * buffer which grows to hold the longest line. Lines are found with memchr()
+ * and handed out with their length, so that none is copied nor truncated.
  */
 
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 65536
 
 typedef struct __rio {
-    int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
-    char *bufptr;          /* Next unread byte in internal buffer */
-    char buf[RIO_BUFSIZE]; /* Internal buffer */
-    struct __rio *prev;    /* Next element in stack */
+    int fd;             /* File descriptor */
+    char *base;         /* Mapped file, or buffer */
+    size_t size;        /* Bytes mapped, or allocated for the buffer */
+    size_t start, end;  /* Unread bytes */
+    bool mapped;        /* Whether base is a mapping */
+    char *line;         /* Writable copy of a mapped line */
+    size_t line_size;   /* Bytes allocated for line */
+    struct __rio *prev; /* Next element in stack */
 } rio_t;
 
 static rio_t *buf_stack;
-static char linebuf[RIO_BUFSIZE];
 
 /* Maximum file descriptor */
 static int fd_max = 0;
@@ -72,6 +106,58 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+static void trie_insert(trie_node_t **root, const char *name, void *value)
+{
+    trie_node_t **link = root, *node = NULL;
+    for (const char *s = name; *s; s++) {
+        while (*link && (*link)->c < *s)
+            link = &(*link)->sibling;
+        if (!*link || (*link)->c != *s) {
+            trie_node_t *n = malloc_or_fail(sizeof(trie_node_t), "trie_insert");
+            n->c = *s;
+            n->value = NULL;
+            n->child = NULL;
+            n->sibling = *link;
+            *link = n;
+        }
+        node = *link;
+        link = &node->child;
+    }
+    if (node)
+        node->value = value;
+}
+
+/* Return the node reached by @prefix, or NULL */
+static trie_node_t *trie_prefix(trie_node_t *root, const char *prefix)
+{
+    trie_node_t *node = NULL, *n = root;
+    for (const char *s = prefix; *s; s++) {
+        while (n && n->c < *s)
+            n = n->sibling;
+        if (!n || n->c != *s)
+            return NULL;
+        node = n;
+        n = n->child;
+    }
+    return node;
+}
+
+static void *trie_find(trie_node_t *root, const char *name)
+{
+    trie_node_t *node = trie_prefix(root, name);
+    return node ? node->value : NULL;
+}
+
+static void trie_free(trie_node_t *node)
+{
+    while (node) {
+        trie_node_t *next = node->sibling;
+        trie_free(node->child);
+        free_block(node, sizeof(trie_node_t));
+        node = next;
+    }
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +173,10 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    trie_insert(&cmd_trie, name, cmd);
 }
 
 /* Add a new parameter */
@@ -109,57 +197,114 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    trie_insert(&param_trie, name, param);
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Arguments of command lines are kept in a bump arena, emptied after each
+ * command, so that interpreting one allocates nothing once the arena is large
+ * enough. Commands do not nest, the arena may thus move when it grows.
+ */
+static char *arena = NULL;
+static size_t arena_size = 0;
+static size_t arena_used = 0;
+
+static void *arena_alloc(size_t bytes)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
+    bytes = (bytes + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (arena_used + bytes > arena_size) {
+        size_t size = arena_size ? arena_size : 256;
+        while (size < arena_used + bytes)
+            size <<= 1;
+        char *bigger = malloc_or_fail(size, "arena_alloc");
+        if (arena) {
+            memcpy(bigger, arena, arena_used);
+            free_block(arena, arena_size);
+        }
+        arena = bigger;
+        arena_size = size;
+    }
+
+    void *p = arena + arena_used;
+    arena_used += bytes;
+    return p;
+}
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+static void arena_release()
+{
+    if (arena)
+        free_block(arena, arena_size);
+    arena = NULL;
+    arena_size = arena_used = 0;
+}
+
+/* Parse the @len bytes of @line into a command line. Words are split in place,
+ * and the byte past the line, such as its newline, is overwritten.
+ */
+static char **parse_args(char *line, size_t len, int *argcp)
+{
+    /* At most one word every two characters, and a terminating NULL */
+    size_t max_argc = (len + 1) / 2 + 1;
+    char **argv = arena_alloc(max_argc * sizeof(char *));
+    line[len] = '\0';
 
-    char *src = line;
-    char *dst = buf;
     bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
+    for (char *c = line; *c; c++) {
+        if (isspace(*c)) {
+            /* Replace white space with null characters */
+            *c = '\0';
+            skipping = true;
+        } else if (skipping) {
+            /* Hit start of new word */
+            argv[argc++] = c;
+            skipping = false;
         }
     }
-    /* Let the last substring is null-terminated */
-    *dst++ = '\0';
+    argv[argc] = NULL;
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
     *argcp = argc;
     return argv;
 }
 
+/* Loops.
+ * Between 'loop n' and its matching 'end', command lines are saved parsed
+ * rather than run, then the block runs n times without parsing them again.
+ * Nested loops are saved with the block, each loop line knowing the index of
+ * its end line.
+ */
+typedef struct {
+    int argc;
+    char **argv;
+    int end;    /* For loop lines, index of the matching end line */
+    int count;  /* For loop lines, times to run the loop */
+    bool timed; /* For loop lines, started by 'time loop n' */
+} block_line_t;
+
+typedef struct {
+    bool recording;
+    bool timed; /* Started by 'time loop n' */
+    int count;  /* Times to run the block */
+    int depth;  /* Nested loops left open */
+    block_line_t *lines;
+    int nlines, size;
+} block_t;
+
+/* Block being recorded */
+static block_t block;
+
+static void block_release(block_t *b)
+{
+    for (int i = 0; i < b->nlines; i++) {
+        block_line_t *l = &b->lines[i];
+        for (int j = 0; j < l->argc; j++)
+            free_string(l->argv[j]);
+        free_array(l->argv, l->argc, sizeof(char *));
+    }
+    if (b->lines)
+        free_array(b->lines, b->size, sizeof(block_line_t));
+    memset(b, 0, sizeof(*b));
+}
+
 /* Handles forced console termination for record_error and do_quit */
 static bool force_quit(int argc, char *argv[])
 {
@@ -168,6 +313,8 @@ static bool force_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(struct __latency_hist));
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -178,13 +325,22 @@ static bool force_quit(int argc, char *argv[])
         free_block(ele, sizeof(param_element_t));
     }
 
-    while (buf_stack)
-        pop_file();
+    trie_free(cmd_trie);
+    trie_free(param_trie);
+    cmd_trie = param_trie = NULL;
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
 
+    /* The command which quits no longer needs its arguments, which lie in
+     * the arena and in the buffer of its input file
+     */
+    while (buf_stack)
+        pop_file();
+    arena_release();
+    block_release(&block);
+
     quit_flag = true;
     return ok;
 }
@@ -200,18 +356,209 @@ static void record_error()
     }
 }
 
+/* Return the histogram bucket which counts a latency of @ns nanoseconds */
+static int latency_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB +
+           ((ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* Return the largest value counted in bucket @i */
+static uint64_t latency_bucket_max(int i)
+{
+    if (i < LAT_SUB)
+        return i;
+    int shift = i / LAT_SUB - 1;
+    return ((uint64_t) (LAT_SUB + i % LAT_SUB + 1) << shift) - 1;
+}
+
+static void latency_record(cmd_element_t *cmd, uint64_t ns)
+{
+    if (!cmd->latency)
+        cmd->latency = calloc_or_fail(1, sizeof(struct __latency_hist),
+                                      "latency_record");
+    struct __latency_hist *h = cmd->latency;
+    h->count++;
+    if (ns > h->max)
+        h->max = ns;
+    h->buckets[latency_bucket(ns)]++;
+}
+
+/* Return the latency which @p percent of runs did not exceed */
+static uint64_t latency_percentile(const struct __latency_hist *h, double p)
+{
+    uint64_t rank = (uint64_t) (p / 100 * h->count + 0.5);
+    if (!rank)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = latency_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Return the index of 'loop' in @argv, 1 when timed, or -1 */
+static int loop_word(int argc, char *argv[])
+{
+    if (!strcmp(argv[0], "loop"))
+        return 0;
+    if (argc > 1 && !strcmp(argv[0], "time") && !strcmp(argv[1], "loop"))
+        return 1;
+    return -1;
+}
+
+static bool get_loop_count(int argc, char *argv[], int *count)
+{
+    if (argc != 2 || !get_int(argv[1], count) || *count < 0) {
+        report(1, "%s takes a non-negative number of iterations", argv[0]);
+        return false;
+    }
+    return true;
+}
+
+/* Save a parsed line into the block being recorded */
+static void block_save(int argc, char *argv[])
+{
+    if (block.nlines == block.size) {
+        int size = block.size ? 2 * block.size : 16;
+        block_line_t *lines =
+            calloc_or_fail(size, sizeof(block_line_t), "block_save");
+        if (block.lines) {
+            memcpy(lines, block.lines, block.nlines * sizeof(block_line_t));
+            free_array(block.lines, block.size, sizeof(block_line_t));
+        }
+        block.lines = lines;
+        block.size = size;
+    }
+
+    block_line_t *l = &block.lines[block.nlines++];
+    l->argc = argc;
+    l->argv = calloc_or_fail(argc, sizeof(char *), "block_save");
+    for (int i = 0; i < argc; i++)
+        l->argv[i] = strsave_or_fail(argv[i], "block_save");
+    l->end = -1;
+}
+
+/* Run lines @from to @to of block @b @count times, and report the time
+ * taken when @timed
+ */
+static bool block_run(const block_t *b, int from, int to, int count,
+                      bool timed)
+{
+    uint64_t start = time_ns();
+    bool ok = true;
+    for (int n = 0; n < count && !quit_flag; n++) {
+        for (int i = from; i < to && !quit_flag; i++) {
+            const block_line_t *l = &b->lines[i];
+            if (l->end >= 0) {
+                ok = block_run(b, i + 1, l->end, l->count, l->timed) && ok;
+                i = l->end;
+            } else {
+                ok = interpret_cmda(l->argc, l->argv) && ok;
+            }
+        }
+    }
+    if (timed && !quit_flag)
+        report(1, "Delta time = %.3f", 1.0E-9 * (time_ns() - start));
+    return ok;
+}
+
+/* Record a line of a block, and run the block once its loop is closed */
+static bool block_record(int argc, char *argv[])
+{
+    int w = loop_word(argc, argv), count = 0;
+    if (w >= 0) {
+        if (!get_loop_count(argc - w, argv + w, &count))
+            return false;
+        block.depth++;
+    } else if (!strcmp(argv[0], "end")) {
+        if (argc != 1) {
+            report(1, "%s takes no arguments", argv[0]);
+            return false;
+        }
+        if (!block.depth) {
+            /* Commands run by the block may quit, which releases the block
+             * being recorded, not this one
+             */
+            block_t b = block;
+            memset(&block, 0, sizeof(block));
+            bool ok = block_run(&b, 0, b.nlines, b.count, b.timed);
+            block_release(&b);
+            return ok;
+        }
+
+        /* Match with the innermost loop left open */
+        int i = block.nlines - 1;
+        while (block.lines[i].end >= 0 ||
+               loop_word(block.lines[i].argc, block.lines[i].argv) < 0)
+            i--;
+        block.lines[i].end = block.nlines;
+        block.depth--;
+    }
+
+    block_save(argc, argv);
+    block.lines[block.nlines - 1].count = count;
+    block.lines[block.nlines - 1].timed = w > 0;
+    return true;
+}
+
+static bool do_loop(int argc, char *argv[])
+{
+    int count;
+    if (!get_loop_count(argc, argv, &count))
+        return false;
+    block.recording = true;
+    block.count = count;
+    return true;
+}
+
+static bool do_end(int argc, char *argv[])
+{
+    report(1, "%s without loop", argv[0]);
+    return false;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int count;
+    if (argc < 3 || !get_int(argv[1], &count) || count < 0) {
+        report(1, "%s takes a number of iterations and a command", argv[0]);
+        return false;
+    }
+    if (!strcmp(argv[2], "loop") || !strcmp(argv[2], "end")) {
+        report(1, "Cannot repeat %s", argv[2]);
+        return false;
+    }
+
+    bool ok = true;
+    for (int n = 0; n < count && !quit_flag; n++)
+        ok = interpret_cmda(argc - 2, argv + 2) && ok;
+    return ok;
+}
+
 /* Execute a command that has already been split into arguments */
 static bool interpret_cmda(int argc, char *argv[])
 {
     if (argc == 0)
         return true;
+    if (block.recording)
+        return block_record(argc, argv);
     /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    cmd_element_t *next_cmd = trie_find(cmd_trie, argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        uint64_t start = time_ns();
         ok = next_cmd->operation(argc, argv);
+        /* Commands are gone after quitting */
+        if (!quit_flag)
+            latency_record(next_cmd, time_ns() - start);
         if (!ok)
             record_error();
     } else {
@@ -223,18 +570,19 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Execute a command from a command line of @len bytes, split in place */
+static bool interpret_cmd(char *cmdline, size_t len)
 {
     if (quit_flag)
         return false;
 
+    /* Commands run no command lines themselves */
+    assert(!arena_used);
     int argc;
-    char **argv = parse_args(cmdline, &argc);
+    char **argv = parse_args(cmdline, len, &argc);
     bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    arena_used = 0;
+    report_flush();
 
     return ok;
 }
@@ -330,17 +678,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter */
+        param_element_t *param = trie_find(param_trie, name);
+        if (param) {
+            int oldval = *param->valp;
+            *param->valp = value;
+            if (param->setter)
+                param->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -389,6 +734,10 @@ static bool do_time(int argc, char *argv[])
     if (argc <= 1) {
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
+    } else if (!block.recording && !strcmp(argv[1], "loop")) {
+        /* The block is timed once it has run */
+        ok = interpret_cmda(argc - 1, argv + 1);
+        block.timed = block.recording;
     } else {
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
@@ -402,6 +751,50 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Print @ns nanoseconds in a suitable unit, right aligned on @width */
+static void report_ns(int width, uint64_t ns)
+{
+    if (ns < 1000)
+        report_noreturn(1, " %*lu ns", width - 3, (unsigned long) ns);
+    else if (ns < 1000000)
+        report_noreturn(1, " %*.1f us", width - 3, ns / 1e3);
+    else if (ns < 1000000000)
+        report_noreturn(1, " %*.1f ms", width - 3, ns / 1e6);
+    else
+        report_noreturn(1, " %*.2f s ", width - 3, ns / 1e9);
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    bool reset = argc == 2 && !strcmp(argv[1], "reset");
+    if (argc > 2 || (argc == 2 && !reset)) {
+        report(1, "%s takes no arguments, or 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!reset)
+        report(1, "%-12s %10s %10s %10s %10s %10s", "command", "calls", "p50",
+               "p90", "p99", "max");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        struct __latency_hist *h = c->latency;
+        if (!h)
+            continue;
+        if (reset) {
+            memset(h, 0, sizeof(*h));
+            continue;
+        }
+        if (!h->count)
+            continue;
+        report_noreturn(1, "%-12s %10lu", c->name, (unsigned long) h->count);
+        report_ns(10, latency_percentile(h, 50));
+        report_ns(10, latency_percentile(h, 90));
+        report_ns(10, latency_percentile(h, 99));
+        report_ns(10, h->max);
+        report(1, "");
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -430,6 +823,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    cmd_trie = NULL;
+    param_trie = NULL;
     err_cnt = 0;
     quit_flag = false;
 
@@ -440,7 +835,16 @@ void init_cmd()
     ADD_COMMAND(quit, "Exit program", "");
     ADD_COMMAND(source, "Read commands from source file", "file");
     ADD_COMMAND(log, "Copy output to file", "file");
-    ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(time, "Time command execution, or a whole loop",
+                "cmd arg ...");
+    ADD_COMMAND(repeat, "Run command n times, parsed once", "n cmd arg ...");
+    ADD_COMMAND(loop, "Run the following commands n times, up to 'end'",
+                "n");
+    ADD_COMMAND(end, "Close the block of a loop", "");
+    ADD_COMMAND(stats,
+                "Show latency percentiles of the commands run so far, or "
+                "forget them",
+                "[reset]");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -470,8 +874,25 @@ static bool push_file(char *fname)
 
     rio_t *rnew = malloc_or_fail(sizeof(rio_t), "push_file");
     rnew->fd = fd;
-    rnew->count = 0;
-    rnew->bufptr = rnew->buf;
+    rnew->start = rnew->end = 0;
+    rnew->mapped = false;
+    rnew->line = NULL;
+    rnew->line_size = 0;
+
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        rnew->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (rnew->base != MAP_FAILED) {
+            madvise(rnew->base, st.st_size, MADV_SEQUENTIAL);
+            rnew->mapped = true;
+            rnew->size = rnew->end = st.st_size;
+        }
+    }
+    if (!rnew->mapped) {
+        rnew->size = RIO_BUFSIZE;
+        rnew->base = malloc_or_fail(rnew->size, "push_file");
+    }
+
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -485,6 +906,12 @@ static void pop_file()
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
         close(rsave->fd);
+        if (rsave->mapped)
+            munmap(rsave->base, rsave->size);
+        else
+            free_block(rsave->base, rsave->size);
+        if (rsave->line)
+            free_block(rsave->line, rsave->line_size);
         free_block(rsave, sizeof(rio_t));
     }
 }
@@ -495,60 +922,87 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Read more of an unmapped file, after the unread bytes moved to the front.
+ * A byte is left past them, to terminate the last line in place.
+ * Return false at EOF.
  */
-static char *readline()
+static bool rio_fill(rio_t *r)
 {
-    char c;
-    char *lptr = linebuf;
+    if (r->start) {
+        memmove(r->base, r->base + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end + 1 == r->size) {
+        char *bigger = malloc_or_fail(2 * r->size, "rio_fill");
+        memcpy(bigger, r->base, r->end);
+        free_block(r->base, r->size);
+        r->base = bigger;
+        r->size *= 2;
+    }
+
+    ssize_t n = read(r->fd, r->base + r->end, r->size - r->end - 1);
+    if (n <= 0)
+        return false;
+    r->end += n;
+    return true;
+}
 
-    if (!buf_stack)
+/* Read command from input file, and store its length into @lenp.
+ * The line is not terminated, but the byte past it may be written. It stays
+ * valid until the next call.
+ * When hit EOF, close that file and return NULL
+ */
+static char *readline(size_t *lenp)
+{
+    rio_t *r = buf_stack;
+    if (!r)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
+    char *line;
+    size_t len;
+    for (;;) {
+        line = r->base + r->start;
+        size_t n = r->end - r->start;
+        const char *nl = memchr(line, '\n', n);
+        if (nl) {
+            len = nl - line;
+            r->start += len + 1;
+            break;
+        }
+        if (r->mapped || !rio_fill(r)) {
+            /* Encountered EOF */
+            if (!n) {
                 pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
                 return NULL;
             }
-        }
-
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+            /* Last line of file did not terminate with newline */
+            len = n;
+            r->start = r->end;
             break;
+        }
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    /* Mapped pages stay read-only, as copying the pages written costs more
+     * than copying the lines
+     */
+    if (r->mapped) {
+        if (len + 1 > r->line_size) {
+            if (r->line)
+                free_block(r->line, r->line_size);
+            r->line_size = len + 1 > 256 ? len + 1 : 256;
+            r->line = malloc_or_fail(r->line_size, "readline");
+        }
+        line = memcpy(r->line, line, len);
     }
-    *lptr++ = '\0';
 
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report(1, "%.*s", (int) len, line);
     }
 
-    return linebuf;
+    *lenp = len;
+    return line;
 }
 
 static bool cmd_done()
@@ -595,13 +1049,14 @@ static int cmd_select(int nfds,
         if (infd == STDIN_FILENO && prompt_flag) {
             char *cmdline = linenoise(prompt);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, strlen(cmdline));
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
+            size_t len;
+            char *cmdline = readline(&len);
             if (cmdline)
-                interpret_cmd(cmdline);
+                interpret_cmd(cmdline, len);
         }
     }
     return 0;
@@ -610,55 +1065,393 @@ static int cmd_select(int nfds,
 bool finish_cmd()
 {
     bool ok = true;
+    if (block.recording) {
+        report(1, "ERROR: loop without end");
+        ok = false;
+    }
     if (!quit_flag)
-        ok = ok && do_quit(0, NULL);
+        ok = do_quit(0, NULL) && ok;
     has_infile = false;
     return ok && err_cnt == 0;
 }
 
-static bool cmd_maybe(const char *target, const char *src)
+/* Offer every name stored below @node, the trie of parameters when @option */
+static void complete_all(trie_node_t *node, bool option,
+                         line_completions_t *lc)
 {
-    for (int i = 0; i < strlen(src); i++) {
-        if (target[i] == '\0')
-            return false;
-        if (src[i] != target[i])
-            return false;
+    for (; node; node = node->sibling) {
+        if (node->value) {
+            if (option) {
+                const param_element_t *param = node->value;
+                char str[128] = "option ";
+                /* if parameter is too long, now we just ignore it */
+                if (strlen(param->name) <= 120) {
+                    strcat(str, param->name);
+                    line_add_completion(lc, str);
+                }
+            } else {
+                const cmd_element_t *cmd = node->value;
+                line_add_completion(lc, cmd->name);
+            }
+        }
+        complete_all(node->child, option, lc);
     }
-    return true;
 }
 
 void completion(const char *buf, line_completions_t *lc)
 {
-    if (strncmp("option ", buf, 7) == 0) {
-        param_element_t *plist = param_list;
+    bool option = strncmp("option ", buf, 7) == 0;
+    trie_node_t *root = option ? param_trie : cmd_trie;
+    const char *prefix = option ? buf + 7 : buf;
 
-        while (plist) {
-            char str[128] = "";
-            /* if parameter is too long, now we just ignore it */
-            if (strlen(plist->name) > 120)
-                continue;
+    if (!*prefix) {
+        complete_all(root, option, lc);
+        return;
+    }
 
-            strcat(str, "option ");
-            strcat(str, plist->name);
-            if (cmd_maybe(str, buf))
-                line_add_completion(lc, str);
+    trie_node_t *node = trie_prefix(root, prefix);
+    if (!node)
+        return;
 
-            plist = plist->next;
+    /* The node matching the prefix, but not its siblings */
+    trie_node_t only = *node;
+    only.sibling = NULL;
+    complete_all(&only, option, lc);
+}
+
+/* Compiled traces.
+ * A trace is compiled into a header, a table of the commands it uses, code
+ * and a table of interned strings. Each instruction of the code is the index
+ * of its command in the table, its number of words including the command
+ * name, then the string ids of its arguments. Arguments stay strings, as
+ * commands parse their own. All fields are 32-bit words in host order.
+ */
+#define QBC_MAGIC "QBC\1"
+
+typedef struct {
+    char magic[4];
+    uint32_t ncmds;       /* Entries of the command table */
+    uint32_t ncode;       /* Words of code */
+    uint32_t nstrings;    /* Entries of the table of string offsets */
+    uint32_t strtab_size; /* Bytes of NUL-terminated strings */
+    uint32_t max_argc;    /* Most words in an instruction */
+} qbc_header_t;
+
+/* Growable array for the compiler */
+typedef struct {
+    char *data;
+    size_t len, size;
+} qbc_buf_t;
+
+static void *qbc_append(qbc_buf_t *b, const void *src, size_t len)
+{
+    if (b->len + len > b->size) {
+        size_t size = b->size ? b->size : 1024;
+        while (size < b->len + len)
+            size <<= 1;
+        char *bigger = malloc_or_fail(size, "qbc_append");
+        if (b->data) {
+            memcpy(bigger, b->data, b->len);
+            free_block(b->data, b->size);
         }
-        return;
+        b->data = bigger;
+        b->size = size;
     }
+    void *p = b->data + b->len;
+    memcpy(p, src, len);
+    b->len += len;
+    return p;
+}
 
-    cmd_element_t *clist = cmd_list;
-    while (clist) {
-        if (cmd_maybe(clist->name, buf))
-            line_add_completion(lc, clist->name);
+static void qbc_append_word(qbc_buf_t *b, uint32_t w)
+{
+    qbc_append(b, &w, sizeof(w));
+}
 
-        clist = clist->next;
+static void qbc_release(qbc_buf_t *b)
+{
+    if (b->data)
+        free_block(b->data, b->size);
+}
+
+/* Strings interned while compiling, indexed by an open-addressing hash set of
+ * 1 + string id, kept at most half full
+ */
+typedef struct {
+    qbc_buf_t strtab, offsets;
+    uint32_t *slots;
+    size_t nslots;
+} qbc_strings_t;
+
+static uint32_t qbc_hash(const char *s)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static const char *qbc_string(const qbc_strings_t *st, uint32_t id)
+{
+    return st->strtab.data + ((const uint32_t *) st->offsets.data)[id];
+}
+
+static uint32_t qbc_intern(qbc_strings_t *st, const char *s)
+{
+    uint32_t n = st->offsets.len / sizeof(uint32_t);
+    if (2 * (n + 1) > st->nslots) {
+        size_t nslots = st->nslots ? 2 * st->nslots : 1024;
+        uint32_t *slots = calloc_or_fail(nslots, sizeof(uint32_t), "qbc_intern");
+        for (uint32_t id = 0; id < n; id++) {
+            size_t i = qbc_hash(qbc_string(st, id)) & (nslots - 1);
+            while (slots[i])
+                i = (i + 1) & (nslots - 1);
+            slots[i] = id + 1;
+        }
+        if (st->slots)
+            free_array(st->slots, st->nslots, sizeof(uint32_t));
+        st->slots = slots;
+        st->nslots = nslots;
+    }
+
+    size_t i = qbc_hash(s) & (st->nslots - 1);
+    for (; st->slots[i]; i = (i + 1) & (st->nslots - 1)) {
+        if (!strcmp(qbc_string(st, st->slots[i] - 1), s))
+            return st->slots[i] - 1;
+    }
+    qbc_append_word(&st->offsets, st->strtab.len);
+    qbc_append(&st->strtab, s, strlen(s) + 1);
+    st->slots[i] = n + 1;
+    return n;
+}
+
+bool compile_trace(const char *src, const char *dst)
+{
+    FILE *in = fopen(src, "r");
+    if (!in) {
+        report(1, "ERROR: Could not open source file '%s'", src);
+        return false;
+    }
+
+    qbc_strings_t st = {0};
+    qbc_buf_t cmds = {0}, code = {0};
+    uint32_t max_argc = 0;
+    bool ok = true;
+    char *line = NULL;
+    size_t line_size = 0;
+    for (int lineno = 1; getline(&line, &line_size, in) != -1; lineno++) {
+        int argc;
+        char **argv = parse_args(line, strlen(line), &argc);
+        if (!argc) {
+            arena_used = 0;
+            continue;
+        }
+        cmd_element_t *cmd = trie_find(cmd_trie, argv[0]);
+        if (!cmd) {
+            report(1, "%s:%d: Unknown command '%s'", src, lineno, argv[0]);
+            ok = false;
+            arena_used = 0;
+            break;
+        }
+
+        /* Commands used are few, a linear search is enough */
+        uint32_t name = qbc_intern(&st, cmd->name);
+        uint32_t ncmds = cmds.len / sizeof(uint32_t), id = 0;
+        while (id < ncmds && ((uint32_t *) cmds.data)[id] != name)
+            id++;
+        if (id == ncmds)
+            qbc_append_word(&cmds, name);
+
+        qbc_append_word(&code, id);
+        qbc_append_word(&code, argc);
+        for (int i = 1; i < argc; i++)
+            qbc_append_word(&code, qbc_intern(&st, argv[i]));
+        if ((uint32_t) argc > max_argc)
+            max_argc = argc;
+        arena_used = 0;
+    }
+    free(line);
+    fclose(in);
+
+    FILE *out = ok ? fopen(dst, "w") : NULL;
+    if (ok && !out) {
+        report(1, "ERROR: Could not open output file '%s'", dst);
+        ok = false;
+    }
+    if (out) {
+        qbc_header_t h = {
+            .magic = QBC_MAGIC,
+            .ncmds = cmds.len / sizeof(uint32_t),
+            .ncode = code.len / sizeof(uint32_t),
+            .nstrings = st.offsets.len / sizeof(uint32_t),
+            .strtab_size = st.strtab.len,
+            .max_argc = max_argc,
+        };
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(cmds.data, 1, cmds.len, out);
+        fwrite(code.data, 1, code.len, out);
+        fwrite(st.offsets.data, 1, st.offsets.len, out);
+        fwrite(st.strtab.data, 1, st.strtab.len, out);
+        if (ferror(out)) {
+            report(1, "ERROR: Could not write '%s'", dst);
+            ok = false;
+        }
+        if (fclose(out))
+            ok = false;
     }
+
+    qbc_release(&cmds);
+    qbc_release(&code);
+    qbc_release(&st.strtab);
+    qbc_release(&st.offsets);
+    if (st.slots)
+        free_array(st.slots, st.nslots, sizeof(uint32_t));
+    return ok;
+}
+
+static bool trace_is_compiled(const char *fname)
+{
+    char magic[4];
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    /* Reading pipes would eat the first command of a text trace */
+    bool compiled = !fstat(fd, &st) && S_ISREG(st.st_mode) &&
+                    read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                    !memcmp(magic, QBC_MAGIC, sizeof(magic));
+    close(fd);
+    return compiled;
+}
+
+/* Execute the code of @h, whose commands are resolved into @cmds */
+static void replay_code(const qbc_header_t *h,
+                        cmd_element_t **cmds,
+                        const uint32_t *code,
+                        const uint32_t *offsets,
+                        const char *strtab)
+{
+    for (uint32_t pc = 0; pc + 2 <= h->ncode && !quit_flag;) {
+        cmd_element_t *cmd = cmds[code[pc]];
+        uint32_t argc = code[pc + 1];
+        pc += 2;
+
+        /* Strings are shared by every instruction, and commands may scribble
+         * over their arguments. Hand them copies in the arena, allocated at
+         * once as the arena may move when it grows.
+         */
+        const uint32_t *args = code + pc;
+        size_t bytes = (argc + 1) * sizeof(char *) + strlen(cmd->name) + 1;
+        for (uint32_t i = 1; i < argc; i++)
+            bytes += strlen(strtab + offsets[args[i - 1]]) + 1;
+        char **argv = arena_alloc(bytes);
+        char *copy = (char *) (argv + argc + 1);
+        for (uint32_t i = 0; i < argc; i++) {
+            const char *s = i ? strtab + offsets[args[i - 1]] : cmd->name;
+            size_t len = strlen(s) + 1;
+            argv[i] = memcpy(copy, s, len);
+            copy += len;
+        }
+        argv[argc] = NULL;
+        pc += argc - 1;
+
+        if (echo) {
+            report_noreturn(1, prompt);
+            for (uint32_t i = 0; i < argc; i++)
+                report_noreturn(1, i ? " %s" : "%s", argv[i]);
+            report(1, "");
+        }
+        interpret_cmda(argc, argv);
+        arena_used = 0;
+        report_flush();
+
+        /* Run source files pushed by the instruction */
+        while (!cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+}
+
+/* Map and run the compiled trace @fname */
+static bool replay_trace(const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        report(1, "ERROR: Could not open source file '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    if ((size_t) st.st_size < sizeof(qbc_header_t)) {
+        report(1, "ERROR: '%s' is not a valid compiled trace", fname);
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        report(1, "ERROR: Could not map '%s'", fname);
+        return false;
+    }
+
+    /* Check that the tables fill the file exactly */
+    const qbc_header_t *h = (const qbc_header_t *) base;
+    uint64_t words = (uint64_t) h->ncmds + h->ncode + h->nstrings;
+    bool ok = words <= (size - sizeof(*h)) / sizeof(uint32_t) &&
+              sizeof(*h) + words * sizeof(uint32_t) + h->strtab_size == size;
+    const uint32_t *table = (const uint32_t *) (h + 1);
+    const uint32_t *code = ok ? table + h->ncmds : NULL;
+    const uint32_t *offsets = ok ? code + h->ncode : NULL;
+    const char *strtab = ok ? (const char *) (offsets + h->nstrings) : NULL;
+    ok = ok && (!h->strtab_size || !strtab[h->strtab_size - 1]);
+    for (uint32_t i = 0; ok && i < h->nstrings; i++)
+        ok = offsets[i] < h->strtab_size;
+
+    /* Resolve the commands, and check the code once for all */
+    cmd_element_t **cmds =
+        ok ? calloc_or_fail(h->ncmds + 1, sizeof(cmd_element_t *), "replay")
+           : NULL;
+    for (uint32_t i = 0; ok && i < h->ncmds; i++) {
+        ok = table[i] < h->nstrings;
+        if (ok && !(cmds[i] = trie_find(cmd_trie, strtab + offsets[table[i]]))) {
+            report(1, "%s: Unknown command '%s'", fname,
+                   strtab + offsets[table[i]]);
+            ok = false;
+        }
+    }
+    for (uint32_t pc = 0; ok && pc < h->ncode;) {
+        ok = pc + 2 <= h->ncode && code[pc] < h->ncmds && code[pc + 1] >= 1 &&
+             code[pc + 1] <= h->max_argc &&
+             code[pc + 1] - 1 <= h->ncode - pc - 2;
+        if (!ok)
+            break;
+        uint32_t argc = code[pc + 1];
+        pc += 2;
+        for (uint32_t i = 1; ok && i < argc; i++)
+            ok = code[pc++] < h->nstrings;
+    }
+
+    if (ok)
+        replay_code(h, cmds, code, offsets, strtab);
+    else
+        report(1, "ERROR: '%s' is not a valid compiled trace", fname);
+
+    if (cmds)
+        free_array(cmds, h->ncmds + 1, sizeof(cmd_element_t *));
+    munmap(base, size);
+    return ok && err_cnt == 0;
 }
 
 bool run_console(char *infile_name)
 {
+    if (infile_name && trace_is_compiled(infile_name)) {
+        has_infile = true;
+        return replay_trace(infile_name);
+    }
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -667,9 +1460,10 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (use_linenoise && (cmdline = linenoise(prompt))) {
-            interpret_cmd(cmdline);
+            /* Before the line is split in place */
             line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
+            interpret_cmd(cmdline, strlen(cmdline));
             line_free(cmdline);
             while (buf_stack && buf_stack->fd != STDIN_FILENO)
                 cmd_select(0, NULL, NULL, NULL, NULL);
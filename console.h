@@ -24,6 +24,7 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    struct __latency_hist *latency; /* Allocated on first run */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -64,7 +65,13 @@ void set_echo(bool on);
 /* Return true if no errors occurred */
 bool finish_cmd();
 
-/* Run command loop.  Non-null infile_name implies read commands from that file
+/* Compile the commands of trace @src into @dst, for run_console() to replay
+ * without parsing them. Return true if successful.
+ */
+bool compile_trace(const char *src, const char *dst);
+
+/* Run command loop.  Non-null infile_name implies read commands from that file,
+ * which may be a compiled trace
  */
 bool run_console(char *infile_name);
 
@@ -0,0 +1,269 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+#include "harness.h"
+
+#define CACHE_LINE 64
+
+/* Hazard pointers per thread, enough for the queue operations */
+#define CQ_HAZARDS 2
+
+/* Retired nodes a thread may hold before it scans for reclaimable ones. Above
+ * twice the number of hazard pointers, a scan always frees half of them.
+ */
+#define CQ_RETIRE_MAX (2 * CQ_MAX_THREADS * CQ_HAZARDS)
+
+typedef struct __cq_node {
+    _Atomic(struct __cq_node *) next;
+    char *value;
+} cq_node_t;
+
+/* @head and @tail are written by consumers and producers respectively, keep
+ * them on their own cache lines.
+ */
+struct __cqueue {
+    _Atomic(cq_node_t *) head;
+    char pad[CACHE_LINE - sizeof(cq_node_t *)];
+    _Atomic(cq_node_t *) tail;
+};
+
+/* Hazard pointer record, owned by one thread at a time */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic(cq_node_t *) hazard[CQ_HAZARDS];
+    atomic_bool active;
+    int nretired;
+    cq_node_t *retired[CQ_RETIRE_MAX];
+} hp_rec_t;
+
+static hp_rec_t hp_recs[CQ_MAX_THREADS];
+static _Thread_local hp_rec_t *hp_self;
+static pthread_key_t hp_key;
+static pthread_once_t hp_once = PTHREAD_ONCE_INIT;
+
+static void node_free(cq_node_t *node)
+{
+    free(node->value);
+    free(node);
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Free the nodes retired by @rec which no thread holds a hazard pointer to */
+static void hp_scan(hp_rec_t *rec)
+{
+    cq_node_t *hazards[CQ_MAX_THREADS * CQ_HAZARDS];
+    size_t n = 0;
+
+    for (int i = 0; i < CQ_MAX_THREADS; i++) {
+        for (int j = 0; j < CQ_HAZARDS; j++) {
+            cq_node_t *node = atomic_load(&hp_recs[i].hazard[j]);
+            if (node)
+                hazards[n++] = node;
+        }
+    }
+    qsort(hazards, n, sizeof(hazards[0]), ptr_cmp);
+
+    int kept = 0;
+    for (int i = 0; i < rec->nretired; i++) {
+        cq_node_t *node = rec->retired[i];
+        if (bsearch(&node, hazards, n, sizeof(hazards[0]), ptr_cmp))
+            rec->retired[kept++] = node;
+        else
+            free(node);
+    }
+    rec->nretired = kept;
+}
+
+/* Hand the record of an exiting thread over, with its retired nodes */
+static void hp_release(void *arg)
+{
+    hp_rec_t *rec = arg;
+
+    hp_scan(rec);
+    atomic_store(&rec->active, false);
+}
+
+static void hp_init(void)
+{
+    pthread_key_create(&hp_key, hp_release);
+}
+
+/* Return the hazard pointer record of the calling thread, NULL if all of
+ * them are taken
+ */
+static hp_rec_t *hp_get(void)
+{
+    if (hp_self)
+        return hp_self;
+
+    pthread_once(&hp_once, hp_init);
+    for (int i = 0; i < CQ_MAX_THREADS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&hp_recs[i].active, &expected,
+                                           true)) {
+            hp_self = &hp_recs[i];
+            pthread_setspecific(hp_key, hp_self);
+            break;
+        }
+    }
+    return hp_self;
+}
+
+/* Load @src into hazard pointer @i, retrying until the hazard covers the value
+ * which is still current
+ */
+static cq_node_t *hp_protect(hp_rec_t *rec,
+                             int i,
+                             _Atomic(cq_node_t *) *src)
+{
+    cq_node_t *node;
+
+    do {
+        node = atomic_load(src);
+        atomic_store(&rec->hazard[i], node);
+    } while (node != atomic_load(src));
+    return node;
+}
+
+/* Free @node once no hazard pointer refers to it anymore */
+static void hp_retire(hp_rec_t *rec, cq_node_t *node)
+{
+    rec->retired[rec->nretired++] = node;
+    if (rec->nretired == CQ_RETIRE_MAX)
+        hp_scan(rec);
+}
+
+cqueue_t *cq_new(void)
+{
+    cqueue_t *q = malloc(sizeof(cqueue_t));
+    cq_node_t *dummy = malloc(sizeof(cq_node_t));
+    if (!q || !dummy) {
+        free(q);
+        free(dummy);
+        return NULL;
+    }
+
+    atomic_init(&dummy->next, NULL);
+    dummy->value = NULL;
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+    return q;
+}
+
+void cq_free(cqueue_t *q)
+{
+    if (!q)
+        return;
+
+    /* The value of the dummy node at the head went to its consumer */
+    cq_node_t *node = atomic_load(&q->head);
+    cq_node_t *next = atomic_load(&node->next);
+    free(node);
+    for (node = next; node; node = next) {
+        next = atomic_load(&node->next);
+        node_free(node);
+    }
+    free(q);
+
+    hp_rec_t *rec = hp_get();
+    if (rec && rec->nretired)
+        hp_scan(rec);
+
+    /* Exited threads may have handed over nodes which were still hazardous
+     * back then, claim their records to free those
+     */
+    for (int i = 0; i < CQ_MAX_THREADS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&hp_recs[i].active, &expected,
+                                           true)) {
+            hp_scan(&hp_recs[i]);
+            atomic_store(&hp_recs[i].active, false);
+        }
+    }
+}
+
+bool cq_insert_tail(cqueue_t *q, const char *s)
+{
+    hp_rec_t *rec = hp_get();
+    if (!q || !rec)
+        return false;
+
+    cq_node_t *node = malloc(sizeof(cq_node_t));
+    if (!node)
+        return false;
+    node->value = strdup(s);
+    if (!node->value) {
+        free(node);
+        return false;
+    }
+    atomic_init(&node->next, NULL);
+
+    for (;;) {
+        cq_node_t *tail = hp_protect(rec, 0, &q->tail);
+        cq_node_t *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail))
+            continue;
+
+        /* Help a producer which has linked its node but not moved the tail */
+        if (next) {
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+        if (atomic_compare_exchange_weak(&tail->next, &next, node)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, node);
+            break;
+        }
+    }
+    atomic_store(&rec->hazard[0], NULL);
+    return true;
+}
+
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize)
+{
+    hp_rec_t *rec = hp_get();
+    if (!q || !rec)
+        return false;
+
+    cq_node_t *head, *next;
+    char *value;
+    for (;;) {
+        head = hp_protect(rec, 0, &q->head);
+        cq_node_t *tail = atomic_load(&q->tail);
+        next = atomic_load(&head->next);
+        atomic_store(&rec->hazard[1], next);
+        if (head != atomic_load(&q->head))
+            continue;
+
+        if (!next) {
+            atomic_store(&rec->hazard[0], NULL);
+            return false;
+        }
+        if (head == tail) {
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+
+        /* @next becomes the new dummy, whose value the winner takes over */
+        value = next->value;
+        if (atomic_compare_exchange_weak(&q->head, &head, next))
+            break;
+    }
+    atomic_store(&rec->hazard[0], NULL);
+    atomic_store(&rec->hazard[1], NULL);
+
+    if (sp && bufsize) {
+        strncpy(sp, value, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+    free(value);
+    hp_retire(rec, head);
+    return true;
+}
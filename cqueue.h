@@ -0,0 +1,62 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/* This program implements a FIFO queue of strings which any number of threads
+ * may operate on at the same time, without locks.
+ *
+ * It is the queue of Michael and Scott, "Simple, Fast, and Practical
+ * Non-Blocking and Blocking Concurrent Queue Algorithms" (PODC 1996), with
+ * nodes reclaimed by hazard pointers as described by Michael, "Hazard
+ * Pointers: Safe Memory Reclamation for Lock-Free Objects" (IEEE TPDS 2004).
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Number of threads which may use concurrent queues at the same time */
+#define CQ_MAX_THREADS 64
+
+typedef struct __cqueue cqueue_t;
+
+/**
+ * cq_new() - Create an empty concurrent queue
+ *
+ * Return: NULL for allocation failed
+ */
+cqueue_t *cq_new(void);
+
+/**
+ * cq_free() - Free all storage used by concurrent queue
+ * @q: queue to be freed, no other thread may be using it
+ */
+void cq_free(cqueue_t *q);
+
+/**
+ * cq_insert_tail() - Insert an element at the tail, like q_insert_tail()
+ * @q: concurrent queue
+ * @s: string would be inserted
+ *
+ * Safe to call from any thread, concurrently with every operation but
+ * cq_free().
+ *
+ * Return: true for success, false for allocation failed, queue is NULL, or
+ * more than CQ_MAX_THREADS threads are using concurrent queues
+ */
+bool cq_insert_tail(cqueue_t *q, const char *s);
+
+/**
+ * cq_remove_head() - Remove the element at the head, like q_remove_head()
+ * @q: concurrent queue
+ * @sp: string would be inserted
+ * @bufsize: size of the string
+ *
+ * If @sp is non-NULL, up to @bufsize - 1 characters of the removed string are
+ * copied to it, plus a null terminator. Safe to call from any thread,
+ * concurrently with every operation but cq_free().
+ *
+ * Return: true if an element was removed, false if the queue is empty, NULL,
+ * or more than CQ_MAX_THREADS threads are using concurrent queues
+ */
+bool cq_remove_head(cqueue_t *q, char *sp, size_t bufsize);
+
+#endif /* LAB0_CQUEUE_H */
@@ -1,13 +1,16 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -36,77 +39,326 @@
 typedef struct __block_element {
     struct __block_element *next, *prev;
     size_t payload_size;
+    size_t capacity;     /* Room for the payload, from its size class */
+    unsigned short site; /* Index in the allocation profiler */
+    bool guarded;        /* Whether placed against a guard page */
+    unsigned int birth;  /* Value of alloc_clock when allocated */
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Allocated blocks are spread over shards by address. Each shard has its own
+ * lock, list of blocks and registry, so that threads seldom contend and the
+ * counts stay exact.
+ *
+ * The registry is an open-addressing hash set with linear probing, so that
+ * cautious mode can check a block in constant time instead of walking the
+ * list. It is kept at most half full.
+ */
+#define SHARDS 16
+#define REGISTRY_MIN_SLOTS 64
+
+typedef struct {
+    pthread_mutex_t lock;
+    block_element_t *allocated;
+    size_t count;
+    block_element_t **registry;
+    size_t registry_mask;
+} shard_t;
+
+static shard_t shards[SHARDS] = {
+    [0 ... SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/* Allocation profiler: call sites indexed by an open-addressing hash table
+ * twice as large as the table of sites itself. The last site gathers the
+ * allocations of callers which do not fit. Lookups are lock-free, only new
+ * sites take @sites_lock, and counters are updated atomically.
+ */
+#define SITE_SLOTS (2 * ALLOC_MAX_SITES)
+
+static alloc_site_t sites[ALLOC_MAX_SITES];
+static size_t nsites = 0;
+/* 1 + index in sites, 0 for free slots */
+static unsigned short site_index[SITE_SLOTS];
+static unsigned int alloc_clock = 0;
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Percent probability of malloc failure */
+/* Failure schedule */
 int fail_probability = 0;
+int fail_nth = 0;
+int fail_every = 0;
+int fail_site = -1;
+static uintptr_t fail_seed = 0;
+static uintptr_t fail_clock = 0; /* Allocations numbered so far */
+
+/* Poisoning policy and bytes it filled or left alone */
+int poison_mode = POISON_FULL;
+int poison_bytes = 16;
+int poison_every = 16;
+static size_t poisoned_bytes = 0;
+static size_t unpoisoned_bytes = 0;
 
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static bool guard_mode = false;
+static bool guard_exhausted = false; /* Warned that mappings ran out */
 
+/* Errors and exceptions concern the thread which raised them */
+static _Thread_local bool error_occurred = false;
+static _Thread_local char *error_message = "";
+
+/* Sanitizers slow down every allocation and memory access several times, so
+ * that the performance traces need more time per command
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#define SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SANITIZED 1
+#endif
+#endif
+
+#ifdef SANITIZED
+static int time_limit = 10;
+#else
 static int time_limit = 1;
+#endif
 
 /* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static _Thread_local jmp_buf env;
+static _Thread_local volatile sig_atomic_t jmp_ready = false;
+static _Thread_local bool time_limited = false;
 
 /* For test_malloc and test_calloc */
 typedef enum {
     TEST_MALLOC,
     TEST_CALLOC,
+    TEST_REALLOC,
 } alloc_t;
 
 /* Internal functions */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+static inline size_t registry_hash(const void *p)
+{
+    /* Fibonacci hashing, blocks are at least 16 bytes apart */
+    return (size_t) (((uintptr_t) p >> 4) * 0x9E3779B97F4A7C15ULL >> 17);
+}
+
+static inline shard_t *shard_of(const block_element_t *b)
+{
+    return &shards[(registry_hash(b) >> 32) & (SHARDS - 1)];
+}
+
+/* Return the slot holding @b, or the empty slot where it would go */
+static size_t registry_slot(const shard_t *sh, const block_element_t *b)
+{
+    size_t i = registry_hash(b) & sh->registry_mask;
+    while (sh->registry[i] && sh->registry[i] != b)
+        i = (i + 1) & sh->registry_mask;
+    return i;
+}
+
+static void registry_grow(shard_t *sh)
+{
+    size_t old_slots = sh->registry ? sh->registry_mask + 1 : 0;
+    size_t slots = old_slots ? old_slots << 1 : REGISTRY_MIN_SLOTS;
+    block_element_t **old = sh->registry;
+
+    sh->registry = calloc(slots, sizeof(block_element_t *));
+    if (!sh->registry) {
+        report_event(MSG_FATAL, "Couldn't allocate block registry");
+        return;
+    }
+    sh->registry_mask = slots - 1;
+
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i])
+            sh->registry[registry_slot(sh, old[i])] = old[i];
+    }
+    free(old);
+}
+
+/* Call with the lock of @sh held, before its count accounts for @b */
+static void registry_insert(shard_t *sh, block_element_t *b)
+{
+    if (!sh->registry || 2 * (sh->count + 1) > sh->registry_mask + 1)
+        registry_grow(sh);
+    sh->registry[registry_slot(sh, b)] = b;
+}
+
+static bool registry_contains(shard_t *sh, const block_element_t *b)
+{
+    pthread_mutex_lock(&sh->lock);
+    bool found = sh->registry && sh->registry[registry_slot(sh, b)];
+    pthread_mutex_unlock(&sh->lock);
+    return found;
+}
+
+/* Call with the lock of @sh held. Return whether @b was registered. */
+static bool registry_remove(shard_t *sh, const block_element_t *b)
+{
+    if (!sh->registry)
+        return false;
+
+    block_element_t **registry = sh->registry;
+    size_t mask = sh->registry_mask;
+    size_t i = registry_slot(sh, b);
+    if (!registry[i])
+        return false;
+
+    /* Shift back the entries of the probe sequence which follow, so that no
+     * tombstone is needed
+     */
+    for (size_t j = (i + 1) & mask; registry[j]; j = (j + 1) & mask) {
+        size_t k = registry_hash(registry[j]) & mask;
+        bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+        if (!stays) {
+            registry[i] = registry[j];
+            i = j;
+        }
+    }
+    registry[i] = NULL;
+    return true;
+}
+
+static inline void stat_add(size_t *stat, size_t n)
+{
+    __atomic_fetch_add(stat, n, __ATOMIC_RELAXED);
+}
+
+/* Fill the @len bytes at @p, within the payload of @b, with FILLCHAR as far
+ * as the poisoning policy asks. Sampling goes by allocation number, so that
+ * the same blocks are poisoned when allocated and when freed.
+ */
+static void poison(const block_element_t *b, unsigned char *p, size_t len)
+{
+    size_t done = len;
+    switch (poison_mode) {
+    case POISON_EDGES:
+        if (len > 2 * (size_t) poison_bytes) {
+            memset(p, FILLCHAR, poison_bytes);
+            memset(p + len - poison_bytes, FILLCHAR, poison_bytes);
+            done = 2 * (size_t) poison_bytes;
+        } else {
+            memset(p, FILLCHAR, len);
+        }
+        break;
+    case POISON_SAMPLED:
+        if (b->birth % poison_every)
+            done = 0;
+        else
+            memset(p, FILLCHAR, len);
+        break;
+    default:
+        memset(p, FILLCHAR, len);
+        break;
+    }
+    stat_add(&poisoned_bytes, done);
+    stat_add(&unpoisoned_bytes, len - done);
+}
+
+/* Return the index of the site of @caller, registering it on first use */
+static size_t site_of(void *caller)
+{
+    size_t i = registry_hash(caller) & (SITE_SLOTS - 1);
+    unsigned short idx;
+    for (; (idx = __atomic_load_n(&site_index[i], __ATOMIC_ACQUIRE));
+         i = (i + 1) & (SITE_SLOTS - 1)) {
+        if (sites[idx - 1].caller == caller)
+            return idx - 1;
+    }
+
+    /* Another thread may have registered sites from slot i onward */
+    pthread_mutex_lock(&sites_lock);
+    for (; (idx = site_index[i]); i = (i + 1) & (SITE_SLOTS - 1)) {
+        if (sites[idx - 1].caller == caller)
+            break;
+    }
+    if (!idx) {
+        if (nsites >= ALLOC_MAX_SITES - 1) {
+            __atomic_store_n(&nsites, ALLOC_MAX_SITES, __ATOMIC_RELAXED);
+            idx = ALLOC_MAX_SITES;
+        } else {
+            sites[nsites].caller = caller;
+            idx = ++nsites;
+            __atomic_store_n(&site_index[i], idx, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&sites_lock);
+    return idx - 1;
+}
+
+static void profile_alloc(block_element_t *b, void *caller)
+{
+    alloc_site_t *site = &sites[b->site = site_of(caller)];
+    stat_add(&site->count, 1);
+    stat_add(&site->bytes, b->payload_size);
+    stat_add(&site->live, 1);
+    stat_add(&site->live_bytes, b->payload_size);
+    b->birth = __atomic_fetch_add(&alloc_clock, 1, __ATOMIC_RELAXED);
+}
+
+/* Account for a block resized in place from @old_size bytes */
+static void profile_resize(const block_element_t *b, size_t old_size)
+{
+    alloc_site_t *site = &sites[b->site];
+    if (b->payload_size > old_size)
+        stat_add(&site->bytes, b->payload_size - old_size);
+    stat_add(&site->live_bytes, b->payload_size - old_size);
+}
+
+static void profile_free(const block_element_t *b)
+{
+    alloc_site_t *site = &sites[b->site];
+    unsigned int age =
+        __atomic_load_n(&alloc_clock, __ATOMIC_RELAXED) - b->birth;
+    int bucket = 0;
+    while (age >= ALLOC_LIFETIME_BASE && bucket < ALLOC_LIFETIME_BUCKETS - 1) {
+        age /= ALLOC_LIFETIME_BASE;
+        bucket++;
+    }
+    stat_add(&site->lifetime[bucket], 1);
+    stat_add(&site->live, -1);
+    stat_add(&site->live_bytes, -b->payload_size);
+}
+
+/* Signal error if @b is not a block currently allocated */
+static bool check_allocated(block_element_t *b, const char *action)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (!registry_contains(shard_of(b), b)) {
+        report_event(MSG_ERROR,
+                     "Attempted to %s unallocated block.  Address = %p",
+                     action, (void *) &b->payload);
+        error_occurred = true;
+        return false;
+    }
+    return true;
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Find header of block, given its payload, about to be freed or resized.
+ * Signal error if doesn't seem like legitimate block, and return NULL if it
+ * cannot be read.
  */
-static block_element_t *find_header(void *p)
+static block_element_t *find_header(void *p, const char *action)
 {
     if (!p) {
-        report_event(MSG_ERROR, "Attempting to free null block");
+        report_event(MSG_ERROR, "Attempting to %s null block", action);
         error_occurred = true;
     }
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
-        }
-    }
+    /* Headers of freed guarded blocks are unmapped */
+    if (guard_mode && !check_allocated(b, action))
+        return NULL;
 
     if (b->magic_header != MAGICHEADER) {
         report_event(
             MSG_ERROR,
-            "Attempted to free unallocated or corrupted block.  Address = %p",
-            p);
+            "Attempted to %s unallocated or corrupted block.  Address = %p",
+            action, p);
         error_occurred = true;
     }
 
@@ -122,72 +374,295 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+/* Guard page mode.
+ * Blocks are mapped on their own, with their payload rounded up to 16 bytes
+ * right against an inaccessible page, so that overruns trap at once. The few
+ * bytes of rounding, filled with FILLCHAR, stand for the footer. Freed blocks
+ * are unmapped, so that later uses trap as well.
+ */
+static size_t page_size()
+{
+    static size_t size = 0;
+    if (!size)
+        size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static inline size_t guarded_room(size_t size)
+{
+    return (size + 15) & ~(size_t) 15;
+}
+
+/* Return the guard page following the payload of @b */
+static inline unsigned char *guard_of(const block_element_t *b)
+{
+    return (unsigned char *) b->payload + guarded_room(b->payload_size);
+}
+
+static inline unsigned char *guarded_base(const block_element_t *b)
+{
+    return (unsigned char *) ((uintptr_t) b & ~(page_size() - 1));
+}
+
+static block_element_t *guarded_new(size_t size)
+{
+    size_t page = page_size();
+    if (size > SIZE_MAX - sizeof(block_element_t) - 3 * page)
+        return NULL;
+
+    size_t room = guarded_room(size);
+    size_t len = (sizeof(block_element_t) + room + page - 1) & ~(page - 1);
+    unsigned char *base = mmap(NULL, len + page, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + len, page, PROT_NONE)) {
+        munmap(base, len + page);
+        return NULL;
+    }
+
+    block_element_t *b =
+        (block_element_t *) (base + len - room - sizeof(block_element_t));
+    memset(b->payload + size, FILLCHAR, room - size);
+    return b;
+}
+
+static void guarded_free(block_element_t *b)
+{
+    unsigned char *base = guarded_base(b);
+    munmap(base, guard_of(b) + page_size() - base);
+}
+
+/* Return whether the bytes between the payload of @b and its guard page are
+ * untouched
+ */
+static bool guarded_intact(const block_element_t *b)
+{
+    for (const unsigned char *c = b->payload + b->payload_size;
+         c < guard_of(b); c++) {
+        if (*c != FILLCHAR)
+            return false;
+    }
+    return true;
+}
+
+const void *guarded_block_at(const void *addr, size_t *size)
+{
+    size_t page = page_size();
+    const unsigned char *guard =
+        (const unsigned char *) ((uintptr_t) addr & ~(page - 1));
+
+    /* No lock is taken, as the caller may be a signal handler */
+    for (int i = 0; i < SHARDS; i++) {
+        const shard_t *sh = &shards[i];
+        if (!sh->registry)
+            continue;
+        for (size_t j = 0; j <= sh->registry_mask; j++) {
+            const block_element_t *b = sh->registry[j];
+            if (b && b->guarded && guard_of(b) == guard) {
+                *size = b->payload_size;
+                return b->payload;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Room reserved for a payload of @size bytes, so that test_realloc() can grow
+ * blocks in place. Sizes are rounded up to 16 bytes, and above 64 bytes to a
+ * quarter of their power of 2, which wastes at most 25%.
+ */
+static size_t size_class(size_t size)
+{
+    if (size <= 64)
+        return (size + 15) & ~(size_t) 15;
+
+    size_t step = ((size_t) 1 << (63 - __builtin_clzl(size))) >> 2;
+    return (size + step - 1) & ~(step - 1);
+}
+
+/* Should this allocation, made from @caller, fail?
+ * Draws are a hash of the seed and of the allocation number, so that they do
+ * not depend on what else consumes random numbers.
+ */
+static bool fail_allocation(void *caller)
+{
+    bool scheduled = fail_probability > 0 || fail_nth > 0 || fail_every > 0;
+    if (!scheduled && fail_site < 0)
+        return false;
+    if (fail_site >= 0 && site_of(caller) != (size_t) fail_site)
+        return false;
+
+    uintptr_t n = __atomic_add_fetch(&fail_clock, 1, __ATOMIC_RELAXED);
+    if (!scheduled)
+        return true;
+    if (fail_nth > 0 && n == (uintptr_t) fail_nth)
+        return true;
+    if (fail_every > 0 && n % fail_every == 0)
+        return true;
+    if (fail_probability <= 0)
+        return false;
+    if (fail_probability >= 100)
+        return true;
+    return random_shuffle(fail_seed + n) <
+           UINTPTR_MAX / 100 * (uintptr_t) fail_probability;
+}
+
+/* Apply restricted allocation mode and failure injection */
+static bool alloc_allowed(alloc_t alloc_type, void *caller)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
             "Calls to malloc are disallowed",
             "Calls to calloc are disallowed",
+            "Calls to realloc are disallowed",
         };
         report_event(MSG_FATAL, "%s", msg_alloc_forbidden[alloc_type]);
-        return NULL;
+        return false;
     }
 
-    if (fail_allocation()) {
+    if (fail_allocation(caller)) {
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
+            "Realloc returning NULL",
         };
         report_event(MSG_WARN, "%s", msg_alloc_failure[alloc_type]);
-        return NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/* Allocate and register a block of @size bytes filled with @fill */
+static void *block_new(size_t size, int fill, void *caller)
+{
+    bool guarded = guard_mode;
+    block_element_t *new_block = guarded ? guarded_new(size) : NULL;
+    if (guarded && !new_block) {
+        /* Each guarded block takes two memory mappings, and the kernel
+         * allows vm.max_map_count of them. Carry on without guard pages.
+         */
+        if (!__atomic_exchange_n(&guard_exhausted, true, __ATOMIC_RELAXED))
+            report_event(MSG_WARN,
+                         "Out of memory mappings for guard pages, new blocks "
+                         "are checked by their footer instead");
+        guarded = false;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+    size_t capacity = guarded ? size : size_class(size);
+    if (!guarded && capacity >= size &&
+        capacity < SIZE_MAX - sizeof(block_element_t) - sizeof(size_t))
+        new_block =
+            malloc(capacity + sizeof(block_element_t) + sizeof(size_t));
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
+        return NULL;
     }
 
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->capacity = capacity;
+    // cppcheck-suppress nullPointerRedundantCheck
+    new_block->guarded = guarded;
     void *p = (void *) &new_block->payload;
-    memset(p, !alloc_type * FILLCHAR, size);
+    profile_alloc(new_block, caller);
+    /* Fresh mappings are zeroed, which is as good a fill */
+    if (!guarded) {
+        *find_footer(new_block) = MAGICFOOTER;
+        if (fill == FILLCHAR)
+            poison(new_block, p, size);
+        else
+            memset(p, fill, size);
+    }
+
+    shard_t *sh = shard_of(new_block);
+    pthread_mutex_lock(&sh->lock);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->next = sh->allocated;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    if (sh->allocated)
+        sh->allocated->prev = new_block;
+    sh->allocated = new_block;
+    registry_insert(sh, new_block);
+    sh->count++;
+    pthread_mutex_unlock(&sh->lock);
 
     return p;
 }
 
-/* Implementation of application functions */
+static void *alloc(alloc_t alloc_type, size_t size, void *caller)
+{
+    if (!alloc_allowed(alloc_type, caller))
+        return NULL;
+    return block_new(size, alloc_type == TEST_CALLOC ? 0 : FILLCHAR, caller);
+}
 
-void *test_malloc(size_t size)
+/* Check the footer of block @b, about to be freed or resized */
+static void check_footer(block_element_t *b, const char *action)
 {
-    return alloc(TEST_MALLOC, size);
+    bool intact =
+        b->guarded ? guarded_intact(b) : *find_footer(b) == MAGICFOOTER;
+    if (!intact) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to %s it",
+                     (void *) &b->payload, action);
+        error_occurred = true;
+    }
 }
 
-// cppcheck-suppress unusedFunction
-void *test_calloc(size_t nelem, size_t elsize)
+/* Unregister, poison and free block @b. Blocks which were not registered are
+ * left alone, as they are not ours to free.
+ */
+static void block_release(block_element_t *b)
 {
-    /* Reference: Malloc tutorial
-     * https://danluu.com/malloc-tutorial/
-     */
-    if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
-        return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    shard_t *sh = shard_of(b);
+    pthread_mutex_lock(&sh->lock);
+    bool registered = registry_remove(sh, b);
+    if (registered) {
+        /* Unlink from list */
+        block_element_t *bn = b->next;
+        block_element_t *bp = b->prev;
+        if (bp)
+            bp->next = bn;
+        else
+            sh->allocated = bn;
+        if (bn)
+            bn->prev = bp;
+        sh->count--;
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    if (!registered) {
+        if (cautious_mode) {
+            report_event(MSG_ERROR,
+                         "Attempted to free unallocated block.  Address = %p",
+                         (void *) &b->payload);
+            error_occurred = true;
+        }
+        return;
+    }
+
+    if (b->magic_header == MAGICHEADER)
+        profile_free(b);
+    if (b->guarded) {
+        guarded_free(b);
+        return;
+    }
+    b->magic_header = MAGICFREE;
+    *find_footer(b) = MAGICFREE;
+    poison(b, b->payload, b->payload_size);
+    free(b);
 }
 
-void test_free(void *p)
+/* Free the block of payload @p */
+static void release(void *p)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
@@ -197,38 +672,119 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    block_element_t *b = find_header(p, "free");
+    if (!b)
+        return;
+    check_footer(b, "free");
+    block_release(b);
+}
+
+static void *resize(void *p, size_t size, void *caller)
+{
+    if (!p)
+        return alloc(TEST_MALLOC, size, caller);
+    if (!size) {
+        release(p);
+        return NULL;
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    if (!alloc_allowed(TEST_REALLOC, caller))
+        return NULL;
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    block_element_t *b = find_header(p, "reallocate");
+    if (!b || (cautious_mode && !check_allocated(b, "reallocate")))
+        return NULL;
+    check_footer(b, "reallocate");
+
+    size_t old_size = b->payload_size;
+    if (!b->guarded && size <= b->capacity) {
+        /* Grow or shrink within the size class, and move the footer */
+        if (size > old_size)
+            poison(b, (unsigned char *) p + old_size, size - old_size);
+        else
+            poison(b, (unsigned char *) p + size, old_size - size);
+        b->payload_size = size;
+        *find_footer(b) = MAGICFOOTER;
+        profile_resize(b, old_size);
+        return p;
+    }
 
-    free(b);
-    allocated_count--;
+    void *new = block_new(size, FILLCHAR, caller);
+    if (!new)
+        return NULL;
+    memcpy(new, p, old_size < size ? old_size : size);
+    block_release(b);
+    return new;
+}
+
+/* A thread inside the harness may hold a shard lock, or a lock of the C
+ * library. Exceptions raised by signal handlers meanwhile are deferred until
+ * it leaves, so that siglongjmp() never leaves a lock behind.
+ */
+static _Thread_local volatile sig_atomic_t harness_depth = 0;
+static _Thread_local volatile sig_atomic_t exception_pending = false;
+
+static inline void harness_enter()
+{
+    harness_depth++;
+}
+
+static inline void harness_leave()
+{
+    if (!--harness_depth && exception_pending) {
+        exception_pending = false;
+        trigger_exception(error_message);
+    }
+}
+
+/* Implementation of application functions */
+
+void *test_malloc(size_t size)
+{
+    harness_enter();
+    void *p = alloc(TEST_MALLOC, size, __builtin_return_address(0));
+    harness_leave();
+    return p;
+}
+
+// cppcheck-suppress unusedFunction
+void *test_calloc(size_t nelem, size_t elsize)
+{
+    /* Reference: Malloc tutorial
+     * https://danluu.com/malloc-tutorial/
+     */
+    if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
+        return NULL;
+
+    harness_enter();
+    void *p =
+        alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0));
+    harness_leave();
+    return p;
+}
+
+void test_free(void *p)
+{
+    harness_enter();
+    release(p);
+    harness_leave();
+}
+
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    harness_enter();
+    void *new = resize(p, size, __builtin_return_address(0));
+    harness_leave();
+    return new;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    harness_enter();
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0));
+    harness_leave();
     if (!new)
         return NULL;
 
@@ -237,7 +793,71 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    harness_enter();
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        count += shards[i].count;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    harness_leave();
+    return count;
+}
+
+static int heap_block_cmp(const void *a, const void *b)
+{
+    const heap_block_t *x = a, *y = b;
+    if (x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+heap_block_t *heap_snapshot(size_t *n)
+{
+    heap_block_t *snap = NULL;
+    size_t count = 0;
+
+    /* Hold every shard so that the snapshot is consistent */
+    harness_enter();
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        count += shards[i].count;
+    }
+
+    snap = malloc((count ? count : 1) * sizeof(heap_block_t));
+    if (snap) {
+        heap_block_t *h = snap;
+        for (int i = 0; i < SHARDS; i++) {
+            for (block_element_t *b = shards[i].allocated; b; b = b->next) {
+                h->addr = b->payload;
+                h->size = b->payload_size;
+                h->seq = b->birth;
+                h++;
+            }
+        }
+    }
+
+    for (int i = SHARDS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&shards[i].lock);
+    harness_leave();
+
+    if (!snap)
+        return NULL;
+    qsort(snap, count, sizeof(heap_block_t), heap_block_cmp);
+    *n = count;
+    return snap;
+}
+
+size_t poison_count(size_t *skipped)
+{
+    *skipped = __atomic_load_n(&unpoisoned_bytes, __ATOMIC_RELAXED);
+    return __atomic_load_n(&poisoned_bytes, __ATOMIC_RELAXED);
+}
+
+const alloc_site_t *alloc_sites(size_t *n)
+{
+    *n = __atomic_load_n(&nsites, __ATOMIC_RELAXED);
+    return sites;
 }
 
 /* Implementation of functions for testing */
@@ -258,6 +878,22 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+void fail_schedule_reset(unsigned int seed)
+{
+    fail_seed = seed;
+    __atomic_store_n(&fail_clock, 0, __ATOMIC_RELAXED);
+}
+
+/* Set/unset guard page mode.
+ * In this mode, each new block is placed against an inaccessible page.
+ */
+void set_guard_mode(bool guard)
+{
+    page_size(); /* Not to query it from a signal handler later */
+    guard_mode = guard;
+    guard_exhausted = false;
+}
+
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
@@ -311,6 +947,15 @@ void trigger_exception(char *msg)
 {
     error_occurred = true;
     error_message = msg;
+    if (harness_depth) {
+        /* A fault raised again before leaving the harness, such as a
+         * segmentation fault, cannot wait
+         */
+        if (exception_pending)
+            report_event(MSG_FATAL, "%s", msg);
+        exception_pending = true;
+        return;
+    }
     if (jmp_ready)
         siglongjmp(env, 1);
     else
@@ -8,21 +8,97 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * Allocation functions may be called from any thread. Error state and
+ * exception handling are kept per thread.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
 
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
-/* Probability of malloc failing, expressed as percent */
+/* Allocation profiler.
+ * Every block remembers the call site which allocated it. Lifetimes are
+ * measured in allocations made until the block is freed, and binned by
+ * powers of ALLOC_LIFETIME_BASE.
+ */
+#define ALLOC_MAX_SITES 512
+#define ALLOC_LIFETIME_BUCKETS 8
+#define ALLOC_LIFETIME_BASE 8
+
+typedef struct {
+    void *caller; /* Return address into the caller, NULL for other sites */
+    size_t count, bytes;
+    size_t live, live_bytes;
+    size_t lifetime[ALLOC_LIFETIME_BUCKETS];
+} alloc_site_t;
+
+/* Return the table of call sites and store its length into @n.
+ * Site ids are positions in this table.
+ */
+const alloc_site_t *alloc_sites(size_t *n);
+
+/* Heap snapshots.
+ * A block is identified by its address together with its sequence number,
+ * the count of allocations made before it, as addresses get reused.
+ */
+typedef struct {
+    const void *addr;
+    size_t size;
+    unsigned int seq;
+} heap_block_t;
+
+/* Return the allocated blocks, sorted by address then sequence number, into
+ * an array to release with free(), and store its length into @n. Return NULL
+ * if out of memory.
+ */
+heap_block_t *heap_snapshot(size_t *n);
+
+/* Poisoning policy.
+ * Payloads of blocks from malloc, and of blocks being freed, are filled with
+ * a marker byte to expose uses of uninitialized or freed memory.
+ * POISON_EDGES fills only the first and last @poison_bytes bytes of each,
+ * POISON_SAMPLED fills one block in @poison_every entirely and leaves the
+ * others alone.
+ */
+typedef enum {
+    POISON_FULL,
+    POISON_EDGES,
+    POISON_SAMPLED,
+    N_POISON_MODES,
+} poison_mode_t;
+
+extern int poison_mode;
+extern int poison_bytes;
+extern int poison_every;
+
+/* Return the number of bytes poisoned so far, and store the number of bytes
+ * the policy left alone into @skipped
+ */
+size_t poison_count(size_t *skipped);
+
+/* Failure injection.
+ * Allocations are numbered from 1 since the schedule was last reset. One
+ * fails when numbered @fail_nth, or a multiple of @fail_every, or else with
+ * a probability of @fail_probability percent, drawn from the seed and its
+ * number so that runs can be replayed. When @fail_site is a site id, only
+ * allocations from that site are numbered and may fail, all of them if no
+ * other mode is set. Zero, or a negative site, disables a mode.
+ */
 extern int fail_probability;
+extern int fail_nth;
+extern int fail_every;
+extern int fail_site;
+
+/* Restart numbering allocations, and draw failures from @seed */
+void fail_schedule_reset(unsigned int seed);
 
 /*
  * Set/unset cautious mode.
@@ -36,7 +112,23 @@ void set_cautious_mode(bool cautious);
  */
 void set_noallocate_mode(bool noallocate);
 
-/* Return whether any errors have occurred since last time checked */
+/*
+ * Set/unset guard page mode.
+ * In this mode, every new block is mapped right against an inaccessible page,
+ * so that overruns fault at once rather than being found when freeing it.
+ * Blocks are unmapped when freed.
+ */
+void set_guard_mode(bool guard);
+
+/* Return the payload of the guarded block whose guard page holds @addr and
+ * store its size into @size, or return NULL. Safe to call from a signal
+ * handler.
+ */
+const void *guarded_block_at(const void *addr, size_t *size);
+
+/* Return whether any errors have occurred in the calling thread since last
+ * time checked
+ */
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
@@ -57,6 +149,7 @@ void trigger_exception(char *msg);
 #define malloc test_malloc
 #define calloc test_calloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
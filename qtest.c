@@ -1,8 +1,13 @@
 /* Implementation of testing code for queue code */
 
+/* dladdr() */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -45,7 +50,9 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "cqueue.h"
 #include "report.h"
+#include "ring.h"
 
 /* Settable parameters */
 
@@ -53,7 +60,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,6 +81,11 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+static int guard_pages = 0;
+
+/* Seed of the allocation failure schedule, shown by 'option' for replays */
+static int fail_seed = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -101,9 +112,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,7 +124,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -239,9 +246,21 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                         ? list_last_entry(current->q, element_t, list)
                         : list_first_entry(current->q, element_t, list);
                 char *cur_inserts = entry->value;
+                /* The copy may live in a block of its own or inline, right
+                 * after the element, but never on top of the element.
+                 */
+                const char *e_begin = (const char *) entry;
+                const char *e_end = (const char *) (entry + 1);
+                bool overlap = cur_inserts && cur_inserts < e_end &&
+                               cur_inserts + strlen(inserts) >= e_begin;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
+                } else if (overlap) {
+                    report(1,
+                           "ERROR: String copy overlaps its queue element");
+                    ok = false;
+                    break;
                 } else if (r == 0 && inserts == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
@@ -667,6 +686,721 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
+static const char *sort_algo_names[N_SORT_ALGO] = {
+    [SORT_MERGE] = "merge",
+    [SORT_MERGE_KEYED] = "keyed",
+    [SORT_NATURAL] = "natural",
+    [SORT_RADIX] = "radix",
+};
+
+static void sortalgo_setter(int oldval)
+{
+    if (q_sort_algo < 0 || q_sort_algo >= N_SORT_ALGO) {
+        report(1, "Unknown sort algorithm %d, keeping %s", q_sort_algo,
+               sort_algo_names[oldval]);
+        q_sort_algo = oldval;
+    }
+}
+
+/* Changing the failure schedule restarts it */
+static void failure_setter(int oldval)
+{
+    fail_schedule_reset(fail_seed);
+}
+
+static void poison_setter(int oldval)
+{
+    if (poison_mode < 0 || poison_mode >= N_POISON_MODES) {
+        report(1, "Unknown poisoning mode %d", poison_mode);
+        poison_mode = oldval;
+    }
+}
+
+static void poisonbytes_setter(int oldval)
+{
+    if (poison_bytes < 0) {
+        report(1, "Number of bytes to poison must not be negative");
+        poison_bytes = oldval;
+    }
+}
+
+static void poisonevery_setter(int oldval)
+{
+    if (poison_every < 1) {
+        report(1, "Sampling period must be positive");
+        poison_every = oldval;
+    }
+}
+
+static void guardpages_setter(int oldval)
+{
+    set_guard_mode(guard_pages);
+}
+
+static void threads_setter(int oldval)
+{
+    if (q_sort_threads < 1 || q_sort_threads > Q_SORT_MAX_THREADS) {
+        report(1, "Number of threads must be within 1 and %d",
+               Q_SORT_MAX_THREADS);
+        q_sort_threads = oldval;
+    }
+}
+
+/* Time q_sort() on a scratch queue and report nanoseconds per element */
+static double sortbench_run(struct list_head *q, int n)
+{
+    double t;
+    init_time(&t);
+    q_sort(q, descend);
+    return delta_time(&t) * 1e9 / n;
+}
+
+static bool do_sortbench(int argc, char *argv[])
+{
+    int n = 100000;
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &n) || n < 1))) {
+        report(1, "%s takes an optional positive number of elements", argv[0]);
+        return false;
+    }
+
+    struct list_head *q = q_new();
+    if (!q) {
+        report(1, "ERROR: Could not allocate scratch queue");
+        return false;
+    }
+
+    bool ok = true;
+    char randstr_buf[MAX_RANDSTR_LEN];
+    for (int i = 0; ok && i < n; i++) {
+        fill_rand_string(randstr_buf, sizeof(randstr_buf));
+        ok = q_insert_tail(q, randstr_buf);
+    }
+
+    if (ok) {
+        report(1, "Sorting %d elements with '%s' on %d thread(s)", n,
+               sort_algo_names[q_sort_algo], q_sort_threads);
+        report(1, "  random   %8.1f ns/element", sortbench_run(q, n));
+        report(1, "  sorted   %8.1f ns/element", sortbench_run(q, n));
+        q_reverse(q);
+        report(1, "  reversed %8.1f ns/element", sortbench_run(q, n));
+    } else
+        report(1, "ERROR: Could not fill scratch queue");
+
+    q_free(q);
+    return ok && !error_check();
+}
+
+/* Start a thread with every signal blocked, so that signals such as SIGALRM
+ * keep interrupting the main thread
+ */
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+
+typedef struct {
+    cqueue_t *q;
+    int id, ops;
+    bool ok;
+} cqbench_arg_t;
+
+/* Alternate insertions and removals on the shared queue. Every thread numbers
+ * its strings, so FIFO order can be checked per producer.
+ */
+static void *cqbench_thread(void *arg)
+{
+    cqbench_arg_t *a = arg;
+    int last[CQ_MAX_THREADS];
+    char buf[32];
+
+    for (int i = 0; i < CQ_MAX_THREADS; i++)
+        last[i] = -1;
+
+    for (int seq = 0; a->ok && seq < a->ops; seq++) {
+        snprintf(buf, sizeof(buf), "%d %d", a->id, seq);
+        if (!cq_insert_tail(a->q, buf)) {
+            a->ok = false;
+            break;
+        }
+        /* Every thread inserts before it removes, the queue is never empty */
+        if (!cq_remove_head(a->q, buf, sizeof(buf))) {
+            a->ok = false;
+            break;
+        }
+
+        char *end;
+        int id = strtol(buf, &end, 10);
+        int val = strtol(end, NULL, 10);
+        if (id < 0 || id >= CQ_MAX_THREADS || val <= last[id])
+            a->ok = false;
+        else
+            last[id] = val;
+    }
+
+    /* Harness errors, such as corrupted blocks, are reported per thread */
+    if (error_check())
+        a->ok = false;
+    return NULL;
+}
+
+/* Run @nthreads threads on a fresh queue and return operations per second */
+static double cqbench_run(int nthreads, int ops, bool *ok)
+{
+    cqbench_arg_t args[CQ_MAX_THREADS];
+    pthread_t threads[CQ_MAX_THREADS];
+    cqueue_t *q = cq_new();
+    if (!q) {
+        *ok = false;
+        return 0;
+    }
+
+    double t;
+    int started = 0;
+    init_time(&t);
+    for (; started < nthreads; started++) {
+        args[started] = (cqbench_arg_t){
+            .q = q, .id = started, .ops = ops, .ok = true};
+        if (start_thread(&threads[started], cqbench_thread, &args[started])) {
+            *ok = false;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        *ok = *ok && args[i].ok;
+    }
+    double elapsed = delta_time(&t);
+
+    if (cq_remove_head(q, NULL, 0))
+        *ok = false;
+    cq_free(q);
+    return 2.0 * started * ops / elapsed;
+}
+
+static bool do_cqbench(int argc, char *argv[])
+{
+    /* The main thread uses the queue too, when it checks and frees it */
+    int max_threads = 4, ops = 200000, limit = CQ_MAX_THREADS - 1;
+    if (argc > 3 ||
+        (argc > 1 && (!get_int(argv[1], &max_threads) || max_threads < 1 ||
+                      max_threads > limit)) ||
+        (argc > 2 && (!get_int(argv[2], &ops) || ops < 1))) {
+        report(1,
+               "%s takes an optional number of threads (up to %d) and of "
+               "operations per thread",
+               argv[0], limit);
+        return false;
+    }
+
+    bool ok = true;
+    report(1, "Concurrent queue, %d insert/remove pairs per thread", ops);
+    for (int n = 1; ok; n *= 2) {
+        if (n > max_threads)
+            n = max_threads;
+        double rate = cqbench_run(n, ops, &ok);
+        report(1, "  %2d thread(s) %12.0f ops/sec", n, rate);
+        if (n == max_threads)
+            break;
+    }
+    if (!ok)
+        report(1,
+               "ERROR: Concurrent queue lost, duplicated or reordered "
+               "elements");
+    return ok && !error_check();
+}
+
+/* Ring buffer queue operated on by the ring commands */
+static ring_t *ring = NULL;
+
+static bool do_rnew(int argc, char *argv[])
+{
+    int capacity = 1024, slot_size = 64;
+    if (argc > 3 || (argc > 1 && !get_int(argv[1], &capacity)) ||
+        (argc > 2 && !get_int(argv[2], &slot_size)) || capacity < 1 ||
+        capacity > (int) RING_MAX_CAPACITY || slot_size < 1 ||
+        slot_size > RING_MAX_SLOT) {
+        report(1,
+               "%s takes an optional capacity (up to %lu) and slot size (up "
+               "to %d)",
+               argv[0], RING_MAX_CAPACITY, RING_MAX_SLOT);
+        return false;
+    }
+
+    ring_free(ring);
+    ring = NULL;
+    if (exception_setup(true))
+        ring = ring_new(capacity, slot_size, false);
+    exception_cancel();
+
+    if (!ring) {
+        report(1, "ERROR: Could not allocate ring");
+        return false;
+    }
+    report(3, "Ring of %zu slots of %d bytes", ring_capacity(ring), slot_size);
+    return !error_check();
+}
+
+static bool do_rpush(int argc, char *argv[])
+{
+    int reps = 1;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    if (argc == 3 && (!get_int(argv[2], &reps) || reps < 1)) {
+        report(1, "Invalid number of insertions '%s'", argv[2]);
+        return false;
+    }
+    if (!ring) {
+        report(3, "Warning: Calling rpush on null ring");
+        return false;
+    }
+
+    bool ok = true;
+    set_noallocate_mode(true);
+    for (int r = 0; ok && r < reps; r++)
+        ok = ring_insert_tail(ring, argv[1]);
+    set_noallocate_mode(false);
+
+    if (!ok)
+        report(1, "ERROR: Ring is full or '%s' does not fit in a slot",
+               argv[1]);
+    report(3, "Ring holds %zu/%zu", ring_size(ring), ring_capacity(ring));
+    return ok && !error_check();
+}
+
+static bool ring_remove(position_t pos, int argc, char *argv[])
+{
+    char removes[RING_MAX_SLOT];
+    if (argc != 1 && argc != 2) {
+        report(1, "%s needs 0-1 arguments", argv[0]);
+        return false;
+    }
+    if (!ring) {
+        report(3, "Warning: Calling %s on null ring", argv[0]);
+        return false;
+    }
+
+    set_noallocate_mode(true);
+    bool ok = pos == POS_TAIL
+                  ? ring_remove_tail(ring, removes, sizeof(removes))
+                  : ring_remove_head(ring, removes, sizeof(removes));
+    set_noallocate_mode(false);
+
+    if (!ok) {
+        report(1, "ERROR: Ring is empty");
+    } else {
+        report(2, "Removed %s from ring", removes);
+        if (argc == 2 && strcmp(removes, argv[1])) {
+            report(1, "ERROR: Removed value %s != expected value %s",
+                   removes, argv[1]);
+            ok = false;
+        }
+    }
+    return ok && !error_check();
+}
+
+static bool do_rpop(int argc, char *argv[])
+{
+    return ring_remove(POS_HEAD, argc, argv);
+}
+
+static bool do_rpopt(int argc, char *argv[])
+{
+    return ring_remove(POS_TAIL, argc, argv);
+}
+
+/* Elements queued at a time by the single-threaded runs of ringbench */
+#define RINGBENCH_BATCH 1024
+#define RINGBENCH_STR "ringbench"
+
+/* Fill the list queue @q up to RINGBENCH_BATCH elements and drain it, over and
+ * over. Return operations per second.
+ */
+static double ringbench_list(struct list_head *q, int n, bool *ok)
+{
+    double t;
+    init_time(&t);
+    for (int done = 0; *ok && done < n; done += RINGBENCH_BATCH) {
+        int batch = n - done < RINGBENCH_BATCH ? n - done : RINGBENCH_BATCH;
+        for (int i = 0; *ok && i < batch; i++)
+            *ok = q_insert_tail(q, RINGBENCH_STR);
+        for (int i = 0; i < batch; i++) {
+            element_t *e = q_remove_head(q, NULL, 0);
+            if (!(*ok = e))
+                break;
+            q_release_element(e);
+        }
+    }
+    return 2.0 * n / delta_time(&t);
+}
+
+/* Same as ringbench_list() with a ring */
+static double ringbench_ring(ring_t *r, int n, bool *ok)
+{
+    char buf[sizeof(RINGBENCH_STR)];
+    double t;
+    init_time(&t);
+    for (int done = 0; *ok && done < n; done += RINGBENCH_BATCH) {
+        int batch = n - done < RINGBENCH_BATCH ? n - done : RINGBENCH_BATCH;
+        for (int i = 0; *ok && i < batch; i++)
+            *ok = ring_insert_tail(r, RINGBENCH_STR);
+        for (int i = 0; *ok && i < batch; i++)
+            *ok = ring_remove_head(r, buf, sizeof(buf));
+    }
+    return 2.0 * n / delta_time(&t);
+}
+
+typedef struct {
+    ring_t *r;
+    int n;
+} ringbench_arg_t;
+
+static void *ringbench_producer(void *arg)
+{
+    const ringbench_arg_t *a = arg;
+    char buf[16];
+
+    for (int i = 0; i < a->n; i++) {
+        snprintf(buf, sizeof(buf), "%d", i);
+        while (!ring_insert_tail(a->r, buf))
+            sched_yield();
+    }
+    return NULL;
+}
+
+/* Pass @n numbered strings from a producer thread to the calling thread
+ * through @r. Return operations per second.
+ */
+static double ringbench_spsc(ring_t *r, int n, bool *ok)
+{
+    ringbench_arg_t arg = {.r = r, .n = n};
+    pthread_t producer;
+    char buf[16];
+    double t;
+
+    init_time(&t);
+    if (start_thread(&producer, ringbench_producer, &arg)) {
+        *ok = false;
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        while (!ring_remove_head(r, buf, sizeof(buf)))
+            sched_yield();
+        if (strtol(buf, NULL, 10) != i)
+            *ok = false;
+    }
+    pthread_join(producer, NULL);
+    return 2.0 * n / delta_time(&t);
+}
+
+static bool do_ringbench(int argc, char *argv[])
+{
+    int n = 1000000;
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &n) || n < 1))) {
+        report(1, "%s takes an optional positive number of elements", argv[0]);
+        return false;
+    }
+
+    struct list_head *q = q_new();
+    ring_t *r = ring_new(RINGBENCH_BATCH, 16, false);
+    bool ok = q && r;
+
+    if (ok) {
+        report(1, "Passing %d elements through each queue", n);
+        double rate = ringbench_list(q, n, &ok);
+        if (!ok) {
+            report(1, "ERROR: List queue failed to allocate an element");
+        } else {
+            report(1, "  list queue        %12.0f ops/sec", rate);
+            rate = ringbench_ring(r, n, &ok);
+            report(1, "  ring              %12.0f ops/sec", rate);
+            rate = ringbench_spsc(r, n, &ok);
+            report(1, "  ring, 2 threads   %12.0f ops/sec", rate);
+            if (!ok)
+                report(1, "ERROR: Queues lost or reordered elements");
+        }
+    } else
+        report(1, "ERROR: Could not allocate scratch queues");
+
+    q_free(q);
+    ring_free(r);
+    return ok && !error_check();
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const alloc_site_t *x = *(const alloc_site_t **) a;
+    const alloc_site_t *y = *(const alloc_site_t **) b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+/* Describe the call site @caller as an offset into its executable or shared
+ * object, which is what addr2line expects for position-independent code.
+ */
+static void site_name(char *buf, size_t size, void *caller)
+{
+    Dl_info info;
+
+    if (!caller) {
+        snprintf(buf, size, "(other sites)");
+        return;
+    }
+    if (!dladdr(caller, &info) || !info.dli_fname) {
+        snprintf(buf, size, "%p", caller);
+        return;
+    }
+
+    /* Point into the call instruction rather than past it */
+    uintptr_t pc = (uintptr_t) caller - 1;
+    const char *file = strrchr(info.dli_fname, '/');
+    file = file ? file + 1 : info.dli_fname;
+    int len = snprintf(buf, size, "%s+0x%lx", file,
+                       (unsigned long) (pc - (uintptr_t) info.dli_fbase));
+    if (info.dli_sname && len > 0 && (size_t) len < size)
+        snprintf(buf + len, size - len, " (%s+0x%lx)", info.dli_sname,
+                 (unsigned long) (pc - (uintptr_t) info.dli_saddr));
+}
+
+static bool do_allocstats(int argc, char *argv[])
+{
+    int limit = ALLOC_MAX_SITES;
+    if (argc > 2 || (argc == 2 && (!get_int(argv[1], &limit) || limit < 1))) {
+        report(1, "%s takes an optional positive number of sites", argv[0]);
+        return false;
+    }
+
+    size_t n;
+    const alloc_site_t *table = alloc_sites(&n);
+    const alloc_site_t *order[ALLOC_MAX_SITES];
+    for (size_t i = 0; i < n; i++)
+        order[i] = &table[i];
+    qsort(order, n, sizeof(order[0]), site_cmp);
+    if ((size_t) limit > n)
+        limit = n;
+
+    size_t skipped;
+    size_t poisoned = poison_count(&skipped);
+    report(1, "Poisoned %zu bytes, skipped %zu bytes", poisoned, skipped);
+
+    report_noreturn(1, "Lifetime in allocations made until freed:");
+    for (size_t i = 0, bound = 1; i < ALLOC_LIFETIME_BUCKETS; i++) {
+        bound *= ALLOC_LIFETIME_BASE;
+        if (i < ALLOC_LIFETIME_BUCKETS - 1)
+            report_noreturn(1, " <%zu", bound);
+        else
+            report(1, " more");
+    }
+
+    for (int i = 0; i < limit; i++) {
+        const alloc_site_t *site = order[i];
+        char name[256];
+        site_name(name, sizeof(name), site->caller);
+        report(1, "site %td %s: %zu allocs, %zu bytes, %zu live (%zu bytes)",
+               site - table, name, site->count, site->bytes, site->live,
+               site->live_bytes);
+        report_noreturn(1, "  lifetime");
+        for (int j = 0; j < ALLOC_LIFETIME_BUCKETS; j++)
+            report_noreturn(1, " %zu", site->lifetime[j]);
+        report(1, "");
+    }
+    return true;
+}
+
+/* Heap snapshots taken by 'snapshot' and compared by 'heapdiff' */
+#define MAX_SNAPSHOTS 16
+
+typedef struct {
+    heap_block_t *blocks;
+    size_t n;
+} snapshot_t;
+
+static snapshot_t snapshots[MAX_SNAPSHOTS];
+static int nsnapshots = 0;
+
+static bool do_snapshot(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (nsnapshots == MAX_SNAPSHOTS) {
+        report(1, "Cannot keep more than %d snapshots", MAX_SNAPSHOTS);
+        return false;
+    }
+
+    snapshot_t *snap = &snapshots[nsnapshots];
+    snap->blocks = heap_snapshot(&snap->n);
+    if (!snap->blocks) {
+        report(1, "Couldn't allocate snapshot");
+        return false;
+    }
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < snap->n; i++)
+        bytes += snap->blocks[i].size;
+    report(1, "Snapshot %d: %zu blocks, %zu bytes", nsnapshots++, snap->n,
+           bytes);
+    return true;
+}
+
+static int heap_block_size_cmp(const void *a, const void *b)
+{
+    const heap_block_t *x = a, *y = b;
+    if (x->size != y->size)
+        return (x->size > y->size) - (x->size < y->size);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/* Report the @n blocks of @diff grouped by size, prefixed by @sign */
+static void heapdiff_report(heap_block_t *diff, size_t n, char sign)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i++)
+        bytes += diff[i].size;
+    report(1, "%c%zu blocks, %zu bytes", sign, n, bytes);
+
+    qsort(diff, n, sizeof(heap_block_t), heap_block_size_cmp);
+    for (size_t i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && diff[j].size == diff[i].size; j++)
+            ;
+        report(1, "  %c%zu blocks of %zu bytes, allocations #%u to #%u", sign,
+               j - i, diff[i].size, diff[i].seq, diff[j - 1].seq);
+    }
+}
+
+static bool do_heapdiff(int argc, char *argv[])
+{
+    int from = nsnapshots - 1, to = -1;
+    if (argc > 3 || (argc > 1 && !get_int(argv[1], &from)) ||
+        (argc > 2 && !get_int(argv[2], &to))) {
+        report(1, "%s takes an optional snapshot and another one to compare",
+               argv[0]);
+        return false;
+    }
+    if (from < 0 || from >= nsnapshots || to < -1 || to >= nsnapshots) {
+        report(1, "No such snapshot, %d taken", nsnapshots);
+        return false;
+    }
+
+    /* Compare with the current heap by default */
+    snapshot_t now = {NULL, 0};
+    if (to < 0)
+        now.blocks = heap_snapshot(&now.n);
+    const snapshot_t *a = &snapshots[from];
+    const snapshot_t *b = to < 0 ? &now : &snapshots[to];
+    heap_block_t *added = malloc((b->n + 1) * sizeof(heap_block_t));
+    heap_block_t *freed = malloc((a->n + 1) * sizeof(heap_block_t));
+    if (!b->blocks || !added || !freed) {
+        report(1, "Couldn't allocate heap diff");
+        free(now.blocks);
+        free(added);
+        free(freed);
+        return false;
+    }
+
+    /* Both snapshots are sorted, merge them */
+    size_t i = 0, j = 0, nadded = 0, nfreed = 0;
+    while (i < a->n || j < b->n) {
+        const heap_block_t *x = i < a->n ? &a->blocks[i] : NULL;
+        const heap_block_t *y = j < b->n ? &b->blocks[j] : NULL;
+        if (x && y && x->addr == y->addr && x->seq == y->seq) {
+            i++;
+            j++;
+        } else if (!y || (x && (x->addr < y->addr ||
+                                (x->addr == y->addr && x->seq < y->seq)))) {
+            freed[nfreed++] = *x;
+            i++;
+        } else {
+            added[nadded++] = *y;
+            j++;
+        }
+    }
+
+    if (to < 0)
+        report(1, "Snapshot %d to now:", from);
+    else
+        report(1, "Snapshot %d to %d:", from, to);
+    heapdiff_report(added, nadded, '+');
+    heapdiff_report(freed, nfreed, '-');
+
+    free(now.blocks);
+    free(added);
+    free(freed);
+    return true;
+}
+
+/* Byte stored at offset @i of the block resized by 'realloc' */
+static inline unsigned char realloc_byte(size_t i)
+{
+    return (unsigned char) (i * 7 + 1);
+}
+
+/* Check that the first @n bytes of @buf still hold their pattern */
+static bool realloc_intact(const unsigned char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (buf[i] != realloc_byte(i))
+            return false;
+    }
+    return true;
+}
+
+static bool do_realloc(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s takes one or more sizes", argv[0]);
+        return false;
+    }
+
+    unsigned char *buf = NULL;
+    size_t size = 0;
+    bool ok = true;
+    error_check();
+
+    for (int i = 1; ok && i < argc; i++) {
+        int n;
+        if (!get_int(argv[i], &n) || n < 1) {
+            report(1, "Invalid size '%s'", argv[i]);
+            ok = false;
+            break;
+        }
+
+        unsigned char *new = test_realloc(buf, n);
+        if (!new) {
+            report(1, "%zu -> %d bytes: failed, block kept", size, n);
+            if (!realloc_intact(buf, size)) {
+                report(1, "ERROR: Failed realloc changed the block");
+                ok = false;
+            }
+            continue;
+        }
+
+        size_t kept = size < (size_t) n ? size : (size_t) n;
+        report(1, "%zu -> %d bytes: %s", size, n,
+               !buf ? "allocated" : new == buf ? "in place" : "moved");
+        if (!realloc_intact(new, kept)) {
+            report(1, "ERROR: Realloc lost the first %zu bytes", kept);
+            ok = false;
+        }
+        /* Fill the block up to its end, where a misplaced footer would be
+         * overwritten and reported by the next realloc or free
+         */
+        for (size_t j = kept; j < (size_t) n; j++)
+            new[j] = realloc_byte(j);
+        buf = new;
+        size = n;
+    }
+
+    test_free(buf);
+    return ok && !error_check();
+}
+
 static bool do_dm(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -855,6 +1589,24 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
+    /* Record the nodes in chain order, so that duplicate strings can be
+     * traced back to the queue they came from.  As in do_sort, big chains
+     * skip the stability check.
+     */
+#define MAX_NODES 100000
+    struct list_head *nodes[MAX_NODES];
+    unsigned no = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry(ctx, &chain.head, chain) {
+        element_t *entry;
+        if (no + ctx->size > MAX_NODES) {
+            no = MAX_NODES + 1;
+            break;
+        }
+        list_for_each_entry(entry, ctx->q, list)
+            nodes[no++] = &entry->list;
+    }
+
     int len = 0;
     set_noallocate_mode(true);
     if (current && exception_setup(true))
@@ -862,7 +1614,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -906,8 +1658,30 @@ static bool do_merge(int argc, char *argv[])
                 ok = false;
                 break;
             }
+
+            /* Ensure duplicates keep the order of the queues they came from */
+            if (no <= MAX_NODES && !strcmp(item->value, next_item->value)) {
+                bool unstable = false;
+                for (unsigned i = 0; i < no; i++) {
+                    if (nodes[i] == cur_l->next) {
+                        unstable = true;
+                        break;
+                    }
+                    if (nodes[i] == cur_l)
+                        break;
+                }
+                if (unstable) {
+                    report(1,
+                           "ERROR: Not stable merge. The duplicate strings "
+                           "\"%s\" are not in the order of their queues.",
+                           item->value);
+                    ok = false;
+                    break;
+                }
+            }
         }
     }
+#undef MAX_NODES
 
     q_show(3);
     return ok && !error_check();
@@ -1158,19 +1932,123 @@ static void console_init()
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
     ADD_COMMAND(shuffle, "Shuffle the queue", "");
+    ADD_COMMAND(sortbench,
+                "Report sorting time per element for random, sorted and "
+                "reversed input (default: n == 100000)",
+                "[n]");
+    ADD_COMMAND(rnew,
+                "Create new ring buffer queue of c slots of s bytes (default: "
+                "c == 1024, s == 64)",
+                "[c [s]]");
+    ADD_COMMAND(rpush, "Insert string str at tail of ring (n times)",
+                "str [n]");
+    ADD_COMMAND(rpop,
+                "Remove from head of ring. Optionally compare to expected "
+                "value str",
+                "[str]");
+    ADD_COMMAND(rpopt,
+                "Remove from tail of ring. Optionally compare to expected "
+                "value str",
+                "[str]");
+    ADD_COMMAND(ringbench,
+                "Report throughput of the list queue and of the ring, single "
+                "and two-threaded (default: n == 1000000)",
+                "[n]");
+    ADD_COMMAND(allocstats,
+                "Report allocations per call site, biggest first (at most n "
+                "sites)",
+                "[n]");
+    ADD_COMMAND(snapshot,
+                "Capture the set of allocated blocks for 'heapdiff'", "");
+    ADD_COMMAND(heapdiff,
+                "Report blocks allocated and freed between snapshots a and b, "
+                "grouped by size (default: a == last, b == current heap)",
+                "[a [b]]");
+    ADD_COMMAND(realloc,
+                "Resize one block to each size in turn, checking its contents",
+                "size ...");
+    ADD_COMMAND(cqbench,
+                "Hammer the lock-free concurrent queue and report throughput "
+                "for 1, 2, 4, ... up to t threads (default: t == 4, "
+                "ops == 200000)",
+                "[t [ops]]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("seed", &fail_seed, "Seed of malloc failures", failure_setter);
+    add_param("failnth", &fail_nth, "Fail the nth malloc from now (0: never)",
+              failure_setter);
+    add_param("failevery", &fail_every,
+              "Fail every kth malloc from now (0: never)", failure_setter);
+    add_param("failsite", &fail_site,
+              "Only fail mallocs from this site id of 'allocstats' (-1: any)",
+              failure_setter);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("sortalgo", &q_sort_algo,
+              "Sort algorithm (0: merge, 1: keyed merge with prefetching, "
+              "2: natural merge, 3: radix)",
+              sortalgo_setter);
+    add_param("threads", &q_sort_threads, "Number of threads sort may use",
+              threads_setter);
+    add_param("pool", &q_use_pool,
+              "Carve elements of newly created queues from slab pools", NULL);
+    add_param("guardpages", &guard_pages,
+              "Place new blocks against inaccessible pages to trap overruns "
+              "(each takes two of the vm.max_map_count mappings, blocks past "
+              "that limit get no guard page)",
+              guardpages_setter);
+    add_param("poison", &poison_mode,
+              "Poisoning of allocated and freed payloads (0: full, 1: first "
+              "and last bytes, 2: sampled blocks)",
+              poison_setter);
+    add_param("poisonbytes", &poison_bytes,
+              "Bytes poisoned at each end of payloads in mode 1",
+              poisonbytes_setter);
+    add_param("poisonevery", &poison_every,
+              "Poison one block in this many in mode 2", poisonevery_setter);
 }
 
 /* Signal handlers */
-static void sigsegv_handler(int sig)
+
+/* Write @msg then @val in base @base, without calling into stdio */
+static void write_num(const char *msg, size_t val, unsigned int base)
 {
+    char buf[2 + 8 * sizeof(size_t)];
+    int i = sizeof(buf);
+    do {
+        buf[--i] = "0123456789abcdef"[val % base];
+        val /= base;
+    } while (val);
+    if (base == 16) {
+        buf[--i] = 'x';
+        buf[--i] = '0';
+    }
+    assert(write(1, msg, strlen(msg)) == (ssize_t) strlen(msg));
+    assert(write(1, buf + i, sizeof(buf) - i) == (ssize_t) (sizeof(buf) - i));
+}
+
+static void sigsegv_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    /* Not safe in a signal handler, but the reports of the faulting command
+     * are worth the risk as the process aborts anyway
+     */
+    report_flush();
+
+    size_t size;
+    const void *block = guarded_block_at(info->si_addr, &size);
+    if (block) {
+        write_num("Segmentation fault occurred.  Overrun of block ",
+                  (size_t) block, 16);
+        write_num(" of size ", size, 10);
+        write_num(" at address ", (size_t) info->si_addr, 16);
+        assert(write(1, "\n", 1) == 1);
+        abort();
+    }
+
     /* Avoid possible non-reentrant signal function be used in signal handler */
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
@@ -1191,16 +2069,18 @@ static void q_init()
 {
     fail_count = 0;
     INIT_LIST_HEAD(&chain.head);
-    signal(SIGSEGV, sigsegv_handler);
+    struct sigaction sa = {
+        .sa_sigaction = sigsegv_handler,
+        .sa_flags = SA_SIGINFO,
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
     signal(SIGALRM, sigalrm_handler);
 }
 
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
         while (chain.size > 0) {
@@ -1213,7 +2093,12 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
+
+    ring_free(ring);
+    ring = NULL;
+
+    while (nsnapshots > 0)
+        free(snapshots[--nsnapshots].blocks);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1227,11 +2112,13 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f FILE][-v LEVEL][-l LOG\n", cmd);
+    printf("Usage: %s [-h] [-f FILE][-v LEVEL][-l LOG][-c FILE -o FILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f FILE   Read commands from FILE\n");
     printf("\t-v LEVEL  Set verbosity level\n");
     printf("\t-l LOG    Echo results to LOG\n");
+    printf("\t-c FILE   Compile trace FILE for faster replay with -f\n");
+    printf("\t-o FILE   Write compiled trace to FILE\n");
     exit(0);
 }
 
@@ -1429,6 +2316,12 @@ uintptr_t os_random(uintptr_t seed)
 #define BUFSIZE 256
 int main(int argc, char *argv[])
 {
+    /* Reports to a file or a pipe are flushed at command boundaries, while a
+     * terminal keeps seeing each line as it is written
+     */
+    if (!isatty(STDOUT_FILENO))
+        setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
+
     /* sanity check for git hook integration */
     if (!sanity_check())
         return -1;
@@ -1438,10 +2331,11 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *compile_name = NULL, *output_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:c:o:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1461,6 +2355,12 @@ int main(int argc, char *argv[])
             }
             break;
         }
+        case 'c':
+            compile_name = optarg;
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
         case 'l':
             strncpy(lbuf, optarg, BUFSIZE);
             buf[BUFSIZE - 1] = '\0';
@@ -1477,11 +2377,22 @@ int main(int argc, char *argv[])
      * with the Unix time.
      */
     srand(os_random(getpid() ^ getppid()));
+    fail_seed = rand();
+    fail_schedule_reset(fail_seed);
 
     q_init();
     init_cmd();
     console_init();
 
+    if (compile_name) {
+        if (!output_name) {
+            printf("Compiling a trace requires an output file\n");
+            usage(argv[0]);
+        }
+        set_verblevel(level);
+        return !compile_trace(compile_name, output_name);
+    }
+
     /* Initialize linenoise only when infile_name not exist */
     if (!infile_name) {
         /* Trigger call back function(auto completion) */
@@ -1,3 +1,6 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,14 +11,14 @@
 typedef struct {
     struct list_head *arr[STACKSIZE];
     int size;
-} stack_t;
+} list_stack_t;
 
-static inline void s_push(stack_t *s, struct list_head *ptr)
+static inline void s_push(list_stack_t *s, struct list_head *ptr)
 {
     s->arr[s->size++] = ptr;
 }
 
-static inline struct list_head *s_pop(stack_t *s)
+static inline struct list_head *s_pop(list_stack_t *s)
 {
     if (s->size == 0)
         return NULL;
@@ -24,29 +27,225 @@ static inline struct list_head *s_pop(stack_t *s)
     return s->arr[s->size];
 }
 
+/* Strings of up to INLINE_STR_MAX bytes, terminator included, are stored inline
+ * right after the list node, so that the element and its string share a single
+ * block and are close to each other when comparing strings.
+ */
+#define INLINE_STR_MAX 24
+
+/* Queue elements and longer strings can be carved from slab pools. Each slab is
+ * obtained with a single malloc() and split into POOL_SLAB_CHUNKS chunks of one
+ * size class, so the allocator is hit once per slab instead of twice per
+ * insertion. Class POOL_NODE holds nodes along with their inline strings, the
+ * remaining classes hold strings of up to 32, 64 and 128 bytes.
+ */
+#define POOL_SLAB_CHUNKS 64
+#define POOL_NODE 0
+#define POOL_STR_MIN_SHIFT 5
+#define POOL_STR_CLASSES 3
+#define POOL_CLASSES (1 + POOL_STR_CLASSES)
+
+typedef struct __pool_slab {
+    struct __pool_slab *next;
+    /* Chunks follow the header */
+} pool_slab_t;
+
+/* A pool lives as long as its queue or any chunk carved from it. Elements can
+ * outlive their queue, e.g. when q_merge() moves them to another queue.
+ */
+typedef struct __pool {
+    size_t refcnt;
+    pool_slab_t *slabs;
+    void *free_list[POOL_CLASSES];
+} pool_t;
+
+/* Where the string of an element is stored, pool classes count from 1 */
+#define STR_HEAP (-1)
+#define STR_INLINE POOL_NODE
+
+/* Number of leading bytes of a string cached as an integer key */
+#define KEY_BYTES sizeof(uint64_t)
+
+/**
+ * qnode_t - Private wrapper of every element created by this file
+ * @pool: pool the node was carved from, NULL if allocated from the heap
+ * @key: first KEY_BYTES bytes of @elem.value, zero padded, packed big-endian
+ * @str_class: STR_HEAP, STR_INLINE or the pool class holding @elem.value
+ * @elem: the element seen by the users of queue.h
+ * @inline_str: storage of @elem.value when @str_class is STR_INLINE
+ *
+ * Comparing @key of two nodes as integers orders them like strcmp() does for
+ * their first KEY_BYTES bytes.
+ */
+typedef struct {
+    pool_t *pool;
+    uint64_t key;
+    int str_class;
+    element_t elem;
+    char inline_str[];
+} qnode_t;
+
+int q_use_pool = 0;
+int q_sort_algo = SORT_MERGE;
+int q_sort_threads = 1;
+
+static inline size_t pool_chunk_size(int cls)
+{
+    if (cls == POOL_NODE)
+        return (sizeof(qnode_t) + INLINE_STR_MAX + sizeof(void *) - 1) &
+               ~(sizeof(void *) - 1);
+    return (size_t) 1 << (POOL_STR_MIN_SHIFT + cls - 1);
+}
+
+/* Return the pool class able to hold a string of @len bytes, or STR_HEAP */
+static inline int pool_str_class(size_t len)
+{
+    for (int cls = 1; cls < POOL_CLASSES; cls++) {
+        if (len <= pool_chunk_size(cls))
+            return cls;
+    }
+    return STR_HEAP;
+}
+
+static pool_t *pool_new()
+{
+    pool_t *pool = malloc(sizeof(pool_t));
+    if (!pool)
+        return NULL;
+
+    memset(pool, 0, sizeof(pool_t));
+    pool->refcnt = 1;
+    return pool;
+}
+
+/* Drop a reference, release every slab once nothing refers to the pool */
+static void pool_put(pool_t *pool)
+{
+    if (--pool->refcnt)
+        return;
+
+    pool_slab_t *slab = pool->slabs;
+    while (slab) {
+        pool_slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    free(pool);
+}
+
+static void *pool_alloc(pool_t *pool, int cls)
+{
+    if (!pool->free_list[cls]) {
+        size_t chunk = pool_chunk_size(cls);
+        pool_slab_t *slab =
+            malloc(sizeof(pool_slab_t) + POOL_SLAB_CHUNKS * chunk);
+        if (!slab)
+            return NULL;
+
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+
+        /* Thread the chunks of the new slab into the free list, lowest
+         * address first so that consecutive insertions stay adjacent.
+         */
+        char *p = (char *) (slab + 1) + POOL_SLAB_CHUNKS * chunk;
+        for (int i = 0; i < POOL_SLAB_CHUNKS; i++) {
+            p -= chunk;
+            *(void **) p = pool->free_list[cls];
+            pool->free_list[cls] = p;
+        }
+    }
+
+    void *p = pool->free_list[cls];
+    pool->free_list[cls] = *(void **) p;
+    pool->refcnt++;
+    return p;
+}
+
+static void pool_free(pool_t *pool, int cls, void *p)
+{
+    *(void **) p = pool->free_list[cls];
+    pool->free_list[cls] = p;
+    pool_put(pool);
+}
+
+static inline const qnode_t *to_node(const element_t *e)
+{
+    return container_of(e, qnode_t, elem);
+}
+
+/* Pack the first KEY_BYTES bytes of a string of @len bytes into a key */
+static inline uint64_t str_key(const char *s, size_t len)
+{
+    unsigned char buf[KEY_BYTES] = {0};
+    memcpy(buf, s, len < KEY_BYTES ? len : KEY_BYTES);
+
+    uint64_t key = 0;
+    for (int i = 0; i < KEY_BYTES; i++)
+        key = (key << 8) | buf[i];
+    return key;
+}
+
+/**
+ * q_cmp() - Compare the strings of two elements created by this file
+ * @a: first element
+ * @b: second element
+ *
+ * Only strings sharing their first KEY_BYTES bytes need strcmp().
+ *
+ * Return: negative, zero or positive as strcmp() does
+ */
+static inline int q_cmp(const element_t *a, const element_t *b)
+{
+    uint64_t ka = to_node(a)->key, kb = to_node(b)->key;
+    if (ka != kb)
+        return ka < kb ? -1 : 1;
+
+    /* A zero last byte means both strings end within the key */
+    if (!(ka & 0xff))
+        return 0;
+    return strcmp(a->value + KEY_BYTES, b->value + KEY_BYTES);
+}
+
 /**
  * create_element() - Create an element
+ * @q: queue the element is created for
  * @s: string to be copied to the element's value
  *
  * Return: the pointer to the element, NULL if allocation failed
  */
-static inline element_t *create_element(char *s)
+static inline element_t *create_element(const queue_t *q, const char *s)
 {
-    element_t *node = malloc(sizeof(element_t));
+    pool_t *pool = q->pool;
+    size_t len = strlen(s) + 1;
+    bool is_inline = len <= INLINE_STR_MAX;
+    qnode_t *node = pool ? pool_alloc(pool, POOL_NODE)
+                         : malloc(sizeof(qnode_t) + (is_inline ? len : 0));
     if (!node)
         return NULL;
 
-    size_t len = strlen(s) + 1;
-    char *val = malloc(len * sizeof(char));
-    if (!val) {
-        free(node);
-        return NULL;
+    int cls = STR_INLINE;
+    char *val = node->inline_str;
+    if (!is_inline) {
+        cls = pool ? pool_str_class(len) : STR_HEAP;
+        val = cls == STR_HEAP ? malloc(len * sizeof(char))
+                              : pool_alloc(pool, cls);
+        if (!val) {
+            if (pool)
+                pool_free(pool, POOL_NODE, node);
+            else
+                free(node);
+            return NULL;
+        }
     }
 
-    strncpy(val, s, len);
-    node->value = val;
+    memcpy(val, s, len);
+    node->pool = pool;
+    node->key = str_key(s, len);
+    node->str_class = cls;
+    node->elem.value = val;
 
-    return node;
+    return &node->elem;
 }
 
 typedef enum _order { NON_DECREASING = 1, NON_INCREASING = -1 } Order;
@@ -85,6 +284,7 @@ static inline int monotonic_from_right(struct list_head *head, Order order)
         if (right != head)
             cnt++;
     }
+    q_to_queue(head)->size = cnt;
     return cnt;
 }
 
@@ -116,6 +316,47 @@ static struct list_head *merge_two_lists(struct list_head *left,
     return head;
 }
 
+/**
+ * merge_keyed() - Merge two lists, comparing cached keys first
+ * @left: left list
+ * @right: right list
+ * @descend: descending order
+ *
+ * Same as merge_two_lists(), but fetches the nodes following the current pair
+ * ahead of time and avoids most strcmp() calls by means of q_cmp().
+ *
+ * Returns: the head of the merged list
+ */
+static struct list_head *merge_keyed(struct list_head *left,
+                                     struct list_head *right,
+                                     bool descend)
+{
+    struct list_head *head = NULL, **ptr = &head, **node;
+    int flag = descend ? -1 : 1;
+
+    for (node = NULL; left && right; *node = (*node)->next) {
+        if (left->next)
+            __builtin_prefetch(
+                to_node(list_entry(left->next, element_t, list)));
+        if (right->next)
+            __builtin_prefetch(
+                to_node(list_entry(right->next, element_t, list)));
+
+        const element_t *l_item = list_entry(left, element_t, list);
+        const element_t *r_item = list_entry(right, element_t, list);
+
+        node = (flag * q_cmp(l_item, r_item) <= 0) ? &left : &right;
+        *ptr = *node;
+        ptr = &(*ptr)->next;
+    }
+    *ptr = (struct list_head *) (((size_t) left) | ((size_t) right));
+    return head;
+}
+
+typedef struct list_head *(*merge_func_t)(struct list_head *,
+                                          struct list_head *,
+                                          bool);
+
 /**
  * rebuild_list() - Rebuild the list to make it circular
  * @head: head of the list
@@ -136,14 +377,42 @@ static inline void rebuild_list(struct list_head *head)
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
+    queue_t *q = malloc(sizeof(queue_t));
 
-    if (!head)
+    if (!q)
         return NULL;
 
-    INIT_LIST_HEAD(head);
+    q->size = 0;
+    q->pool = NULL;
+    if (q_use_pool) {
+        q->pool = pool_new();
+        if (!q->pool) {
+            free(q);
+            return NULL;
+        }
+    }
 
-    return head;
+    INIT_LIST_HEAD(&q->head);
+
+    return &q->head;
+}
+
+/* Release an element and its string */
+void q_release_element(element_t *e)
+{
+    qnode_t *node = container_of(e, qnode_t, elem);
+    pool_t *pool = node->pool;
+
+    /* Inline strings go away along with the node */
+    if (node->str_class == STR_HEAP)
+        free(e->value);
+    else if (node->str_class != STR_INLINE)
+        pool_free(pool, node->str_class, e->value);
+
+    if (pool)
+        pool_free(pool, POOL_NODE, node);
+    else
+        free(node);
 }
 
 /* Free all storage used by queue */
@@ -155,12 +424,13 @@ void q_free(struct list_head *head)
     element_t *item, *is;
 
     /* cppcheck-suppress uninitvar */
-    list_for_each_entry_safe(item, is, head, list) {
-        free(item->value);
-        free(item);
-    }
+    list_for_each_entry_safe(item, is, head, list)
+        q_release_element(item);
 
-    free(head);
+    queue_t *q = q_to_queue(head);
+    if (q->pool)
+        pool_put(q->pool);
+    free(q);
 }
 
 /* Insert an element at head of queue */
@@ -169,11 +439,13 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *node = create_element(s);
+    queue_t *q = q_to_queue(head);
+    element_t *node = create_element(q, s);
     if (!node)
         return false;
 
     list_add(&node->list, head);
+    q->size++;
 
     return true;
 }
@@ -184,11 +456,13 @@ bool q_insert_tail(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *node = create_element(s);
+    queue_t *q = q_to_queue(head);
+    element_t *node = create_element(q, s);
     if (!node)
         return false;
 
     list_add_tail(&node->list, head);
+    q->size++;
 
     return true;
 }
@@ -209,6 +483,7 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
     }
 
     list_del(&node->list);
+    q_to_queue(head)->size--;
 
     return node;
 }
@@ -229,6 +504,7 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
     }
 
     list_del(&node->list);
+    q_to_queue(head)->size--;
 
     return node;
 }
@@ -236,15 +512,10 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
-    if (!head || list_empty(head))
+    if (!head)
         return 0;
 
-    int count = 0;
-    struct list_head *node;
-    list_for_each(node, head)
-        count++;
-
-    return count;
+    return q_to_queue(head)->size;
 }
 
 /* Delete the middle node in queue */
@@ -266,6 +537,7 @@ bool q_delete_mid(struct list_head *head)
     /* Delete the element */
     list_del(tortoise);
     q_release_element(list_entry(tortoise, element_t, list));
+    q_to_queue(head)->size--;
 
     return true;
 }
@@ -278,6 +550,7 @@ bool q_delete_dup(struct list_head *head)
         return false;
 
     bool is_dup = false;
+    int deleted = 0;
     element_t *prev = NULL, *item, *is;
 
     /* cppcheck-suppress uninitvar */
@@ -286,10 +559,12 @@ bool q_delete_dup(struct list_head *head)
             is_dup = true;
             list_del(&item->list);
             q_release_element(item);
+            deleted++;
         } else {
             if (is_dup) {
                 list_del(&prev->list);
                 q_release_element(prev);
+                deleted++;
                 is_dup = false;
             }
             prev = item;
@@ -298,7 +573,9 @@ bool q_delete_dup(struct list_head *head)
     if (is_dup) {
         list_del(&prev->list);
         q_release_element(prev);
+        deleted++;
     }
+    q_to_queue(head)->size -= deleted;
     return true;
 }
 
@@ -375,13 +652,15 @@ void q_reverseK(struct list_head *head, int k)
     }
 }
 
-/* Sort elements of queue in ascending/descending order */
-void q_sort(struct list_head *head, bool descend)
+/**
+ * merge_sort() - Bottom-up merge sort keeping a stack of sorted runs
+ * @head: header of the list
+ * @descend: descending order
+ * @merge: function merging two sorted runs
+ */
+static void merge_sort(struct list_head *head, bool descend, merge_func_t merge)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
-
-    stack_t stack = {.size = 0};
+    list_stack_t stack = {.size = 0};
 
     unsigned int count = 0;
     struct list_head *node, *safe;
@@ -395,7 +674,7 @@ void q_sort(struct list_head *head, bool descend)
                 break;
             struct list_head *right = s_pop(&stack);
             struct list_head *left = s_pop(&stack);
-            s_push(&stack, merge_two_lists(left, right, descend));
+            s_push(&stack, merge(left, right, descend));
         }
         count = next_count;
     }
@@ -403,7 +682,7 @@ void q_sort(struct list_head *head, bool descend)
     while (stack.size > 1) {
         struct list_head *s1 = s_pop(&stack);
         struct list_head *s2 = s_pop(&stack);
-        s_push(&stack, merge_two_lists(s2, s1, descend));
+        s_push(&stack, merge(s2, s1, descend));
     }
 
     struct list_head *first = s_pop(&stack);
@@ -412,6 +691,577 @@ void q_sort(struct list_head *head, bool descend)
     rebuild_list(head);
 }
 
+/* Natural merge sort in the style of Timsort. Existing ascending runs are kept
+ * as they are and descending ones are reversed, except for elements comparing
+ * equal, which keeps the sort stable. Runs are merged according to the Timsort
+ * stack invariants, and a merge switches to galloping when one side keeps
+ * winning.
+ */
+
+/* Upper bound of pending runs, as in CPython's listsort */
+#define MAX_PENDING_RUNS 85
+
+/* Consecutive wins of one side before a merge starts galloping */
+#define MIN_GALLOP 7
+
+/* Compare two nodes in the requested order, like strcmp() */
+#define RUN_CMP(a, b, flag)                            \
+    ((flag) * q_cmp(list_entry(a, element_t, list), \
+                    list_entry(b, element_t, list)))
+
+/* Tell whether node @a must stay in front of node @b, ties included */
+#define RUN_LE(a, b, flag) (RUN_CMP(a, b, flag) <= 0)
+
+/**
+ * run_t - A sorted, NULL-terminated run
+ * @head: first node
+ * @tail: last node
+ * @len: number of nodes
+ */
+typedef struct {
+    struct list_head *head, *tail;
+    size_t len;
+} run_t;
+
+/**
+ * next_run() - Cut the next natural run from the front of a list
+ * @list: pointer to the first node of the remaining list, advanced past the run
+ * @flag: 1 for ascending order, -1 for descending order
+ *
+ * Returns: the run, in the requested order
+ */
+static run_t next_run(struct list_head **list, int flag)
+{
+    struct list_head *node = *list, *next = node->next;
+    run_t run = {.head = node, .tail = node, .len = 1};
+
+    if (next && RUN_CMP(node, next, flag) > 0) {
+        /* Descending, reverse it while walking. An element comparing equal to
+         * the previous one is put right behind it instead, so that equal
+         * elements keep their original order.
+         */
+        int cmp;
+        node->next = NULL;
+        while (next && (cmp = RUN_CMP(node, next, flag)) >= 0) {
+            struct list_head *safe = next->next;
+            if (cmp) {
+                next->next = run.head;
+                run.head = next;
+            } else {
+                next->next = node->next;
+                node->next = next;
+            }
+            node = next;
+            next = safe;
+            run.len++;
+        }
+    } else {
+        while (next && RUN_LE(node, next, flag)) {
+            node = next;
+            next = next->next;
+            run.len++;
+        }
+        node->next = NULL;
+        run.tail = node;
+    }
+
+    *list = next;
+    return run;
+}
+
+/* Walk @n nodes forward, NULL if the list ends before */
+static inline struct list_head *run_advance(struct list_head *node, size_t n)
+{
+    while (node && n--)
+        node = node->next;
+    return node;
+}
+
+/**
+ * gallop() - Find how far a winning side keeps winning
+ * @node: first node of the winning side, known to go in front of @pivot
+ * @pivot: first node of the other side
+ * @strict: whether ties go behind @pivot
+ * @flag: 1 for ascending order, -1 for descending order
+ *
+ * Probes nodes 1, 3, 7, ... positions ahead, then narrows down the last gap
+ * by bisection. The list still has to be walked, but only a logarithmic number
+ * of nodes is compared with @pivot.
+ *
+ * Returns: the last node that goes in front of @pivot
+ */
+static struct list_head *gallop(struct list_head *node,
+                                const struct list_head *pivot,
+                                bool strict,
+                                int flag)
+{
+#define GALLOP_WINS(n) \
+    ((n) && (strict ? !RUN_LE(pivot, n, flag) : RUN_LE(n, pivot, flag)))
+
+    size_t step = 1;
+    struct list_head *probe;
+    while (GALLOP_WINS(probe = run_advance(node, step))) {
+        node = probe;
+        step <<= 1;
+    }
+
+    /* The answer lies within the next step - 1 nodes after @node */
+    while (step > 1) {
+        size_t half = step >> 1;
+        probe = run_advance(node, half);
+        if (GALLOP_WINS(probe)) {
+            node = probe;
+            step -= half;
+        } else
+            step = half;
+    }
+    return node;
+#undef GALLOP_WINS
+}
+
+/**
+ * merge_runs() - Merge two adjacent runs, @a being the leftmost one
+ * @a: left run
+ * @b: right run
+ * @flag: 1 for ascending order, -1 for descending order
+ *
+ * Returns: the merged run
+ */
+static run_t merge_runs(run_t a, run_t b, int flag)
+{
+    run_t run = {.len = a.len + b.len};
+
+    /* Runs that do not overlap are simply concatenated */
+    if (RUN_LE(a.tail, b.head, flag)) {
+        a.tail->next = b.head;
+        run.head = a.head;
+        run.tail = b.tail;
+        return run;
+    }
+    if (!RUN_LE(a.head, b.tail, flag)) {
+        b.tail->next = a.head;
+        run.head = b.head;
+        run.tail = a.tail;
+        return run;
+    }
+
+    struct list_head *head = NULL, **ptr = &head;
+    struct list_head *x = a.head, *y = b.head;
+    int x_wins = 0, y_wins = 0;
+    while (x && y) {
+        struct list_head *last;
+        if (RUN_LE(x, y, flag)) {
+            last = ++x_wins < MIN_GALLOP ? x : gallop(x, y, false, flag);
+            y_wins = 0;
+            *ptr = x;
+            x = last->next;
+        } else {
+            last = ++y_wins < MIN_GALLOP ? y : gallop(y, x, true, flag);
+            x_wins = 0;
+            *ptr = y;
+            y = last->next;
+        }
+        ptr = &last->next;
+    }
+    *ptr = x ? x : y;
+
+    run.head = head;
+    run.tail = x ? a.tail : b.tail;
+    return run;
+}
+
+/* Merge the runs at @i and @i + 1 of the stack of pending runs */
+static int merge_at(run_t *stack, int n, int i, int flag)
+{
+    stack[i] = merge_runs(stack[i], stack[i + 1], flag);
+    if (i + 2 < n)
+        stack[i + 1] = stack[i + 2];
+    return n - 1;
+}
+
+/* Restore the Timsort invariants on the stack of @n pending runs */
+static int merge_collapse(run_t *stack, int n, int flag)
+{
+    while (n > 1) {
+        int i = n - 2;
+        if ((i > 0 && stack[i - 1].len <= stack[i].len + stack[i + 1].len) ||
+            (i > 1 && stack[i - 2].len <= stack[i - 1].len + stack[i].len)) {
+            if (stack[i - 1].len < stack[i + 1].len)
+                i--;
+        } else if (stack[i].len > stack[i + 1].len)
+            break;
+        n = merge_at(stack, n, i, flag);
+    }
+    return n;
+}
+
+/* Sort a non-empty, NULL-terminated list, and return it as a single run */
+static run_t natural_sort_list(struct list_head *list, int flag)
+{
+    run_t stack[MAX_PENDING_RUNS];
+    int n = 0;
+
+    while (list) {
+        stack[n++] = next_run(&list, flag);
+        n = merge_collapse(stack, n, flag);
+    }
+    while (n > 1) {
+        int i = n - 2;
+        if (i > 0 && stack[i - 1].len < stack[i + 1].len)
+            i--;
+        n = merge_at(stack, n, i, flag);
+    }
+    return stack[0];
+}
+
+static void natural_sort(struct list_head *head, bool descend)
+{
+    head->prev->next = NULL;
+    run_t run = natural_sort_list(head->next, descend ? -1 : 1);
+
+    head->next = run.head;
+    run.head->prev = head;
+    rebuild_list(head);
+}
+
+/* MSD radix sort. Nodes are distributed into 256 buckets by the byte at the
+ * current depth, and every bucket holding more than one distinct string is
+ * sorted recursively at the next depth. Buckets are kept on the stack, so the
+ * sort allocates nothing. Appending to buckets preserves the original order,
+ * and strings that compare equal all end up in the bucket of the terminating
+ * byte, which is never reordered, so the sort is stable.
+ */
+#define RADIX_BUCKETS 256
+
+/* Smaller buckets are merge sorted instead */
+#define RADIX_CUTOFF 32
+
+/* Deeper buckets, i.e. strings with longer common prefixes, are merge sorted
+ * instead, which bounds the stack usage.
+ */
+#define RADIX_MAX_DEPTH 32
+
+/* Byte of a string at @depth, taken from the cached key when possible */
+static inline unsigned char radix_byte(const struct list_head *node,
+                                       size_t depth)
+{
+    const element_t *e = list_entry(node, element_t, list);
+    if (depth < KEY_BYTES)
+        return to_node(e)->key >> (8 * (KEY_BYTES - 1 - depth));
+    return e->value[depth];
+}
+
+/**
+ * radix_sort_list() - Sort a NULL-terminated list sharing a common prefix
+ * @list: first node of the list
+ * @len: number of nodes
+ * @depth: length of the prefix every string of @list shares
+ * @flag: 1 for ascending order, -1 for descending order
+ *
+ * Returns: the sorted list as a run
+ */
+static run_t radix_sort_list(struct list_head *list,
+                             size_t len,
+                             size_t depth,
+                             int flag)
+{
+    run_t bucket[RADIX_BUCKETS];
+    int lo, hi;
+
+    /* Go deeper without recursing as long as all strings share the byte */
+    for (;; depth++) {
+        if (len < RADIX_CUTOFF || depth >= RADIX_MAX_DEPTH)
+            return natural_sort_list(list, flag);
+
+        lo = RADIX_BUCKETS;
+        hi = -1;
+        for (struct list_head *node = list; node;) {
+            struct list_head *next = node->next;
+            int c = radix_byte(node, depth);
+
+            /* Only buckets within [lo, hi] are initialized */
+            if (lo > hi) {
+                bucket[c].len = 0;
+                lo = hi = c;
+            } else if (c < lo) {
+                while (lo > c)
+                    bucket[--lo].len = 0;
+            } else if (c > hi) {
+                while (hi < c)
+                    bucket[++hi].len = 0;
+            }
+
+            node->next = NULL;
+            if (bucket[c].len++)
+                bucket[c].tail->next = node;
+            else
+                bucket[c].head = node;
+            bucket[c].tail = node;
+            node = next;
+        }
+
+        if (lo != hi || !lo)
+            break;
+        list = bucket[lo].head;
+    }
+
+    /* Concatenate the buckets in the requested order, the terminating byte
+     * sorting first when ascending and last when descending.
+     */
+    run_t run = {.head = NULL, .tail = NULL, .len = len};
+    for (int n = 0; n <= hi - lo; n++) {
+        int c = flag > 0 ? lo + n : hi - n;
+        if (!bucket[c].len)
+            continue;
+
+        run_t sub = bucket[c];
+        if (c && sub.len > 1)
+            sub = radix_sort_list(sub.head, sub.len, depth + 1, flag);
+        if (run.tail)
+            run.tail->next = sub.head;
+        else
+            run.head = sub.head;
+        run.tail = sub.tail;
+    }
+    return run;
+}
+
+static void radix_sort(struct list_head *head, bool descend)
+{
+    head->prev->next = NULL;
+    run_t run = radix_sort_list(head->next, q_size(head), 0, descend ? -1 : 1);
+
+    head->next = run.head;
+    run.head->prev = head;
+    rebuild_list(head);
+}
+
+/* Sort with the algorithm selected by q_sort_algo, on the calling thread */
+static void sort_serial(struct list_head *head, bool descend)
+{
+    switch (q_sort_algo) {
+    case SORT_MERGE_KEYED:
+        merge_sort(head, descend, merge_keyed);
+        break;
+    case SORT_NATURAL:
+        natural_sort(head, descend);
+        break;
+    case SORT_RADIX:
+        radix_sort(head, descend);
+        break;
+    default:
+        merge_sort(head, descend, merge_two_lists);
+        break;
+    }
+}
+
+/* Parallel sort. The queue is cut into contiguous parts which are sorted on a
+ * small pool of worker threads, then neighboring parts are merged pairwise in
+ * rounds, each round in parallel as well. Where the cuts fall only depends on
+ * the size of the queue and merges favor the left part on ties, so the result
+ * is deterministic and the sort stays stable.
+ */
+
+/* Queues are not cut into parts smaller than this */
+#define PARALLEL_MIN_PART 8192
+
+typedef struct {
+    void (*fn)(void *arg);
+    void *arg;
+} task_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    pthread_t threads[Q_SORT_MAX_THREADS];
+    int nthreads;
+    task_t *tasks;
+    int ntasks, next, pending;
+    bool stop;
+} workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *worker_main(void *arg)
+{
+    pthread_mutex_lock(&workers.lock);
+    for (;;) {
+        while (!workers.stop && workers.next >= workers.ntasks)
+            pthread_cond_wait(&workers.work, &workers.lock);
+        if (workers.stop)
+            break;
+
+        const task_t *task = &workers.tasks[workers.next++];
+        pthread_mutex_unlock(&workers.lock);
+        task->fn(task->arg);
+        pthread_mutex_lock(&workers.lock);
+        if (!--workers.pending)
+            pthread_cond_signal(&workers.done);
+    }
+    pthread_mutex_unlock(&workers.lock);
+    return NULL;
+}
+
+static void workers_stop(void)
+{
+    pthread_mutex_lock(&workers.lock);
+    workers.stop = true;
+    pthread_cond_broadcast(&workers.work);
+    pthread_mutex_unlock(&workers.lock);
+
+    for (int i = 0; i < workers.nthreads; i++)
+        pthread_join(workers.threads[i], NULL);
+    workers.nthreads = 0;
+}
+
+/* Make sure @n threads, the calling one included, can run tasks */
+static void workers_grow(int n)
+{
+    if (workers.nthreads >= n - 1)
+        return;
+    if (!workers.nthreads)
+        atexit(workers_stop);
+
+    /* Workers block every signal, so that SIGALRM keeps interrupting the
+     * thread which armed the alarm.
+     */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    while (workers.nthreads < n - 1 &&
+           !pthread_create(&workers.threads[workers.nthreads], NULL,
+                           worker_main, NULL))
+        workers.nthreads++;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Run @n tasks on the pool and the calling thread, return once all are done */
+static void workers_run(task_t *tasks, int n)
+{
+    pthread_mutex_lock(&workers.lock);
+    workers.tasks = tasks;
+    workers.ntasks = n;
+    workers.next = 0;
+    workers.pending = n;
+    pthread_cond_broadcast(&workers.work);
+
+    while (workers.next < workers.ntasks) {
+        const task_t *task = &tasks[workers.next++];
+        pthread_mutex_unlock(&workers.lock);
+        task->fn(task->arg);
+        pthread_mutex_lock(&workers.lock);
+        workers.pending--;
+    }
+    while (workers.pending)
+        pthread_cond_wait(&workers.done, &workers.lock);
+    workers.ntasks = workers.next = 0;
+    pthread_mutex_unlock(&workers.lock);
+}
+
+typedef struct {
+    queue_t q;
+    run_t run;
+    bool descend;
+} sort_part_t;
+
+static void sort_part(void *arg)
+{
+    sort_part_t *part = arg;
+    struct list_head *head = &part->q.head;
+
+    sort_serial(head, part->descend);
+    head->prev->next = NULL;
+    part->run.head = head->next;
+    part->run.tail = head->prev;
+    part->run.len = part->q.size;
+}
+
+typedef struct {
+    run_t *left;
+    const run_t *right;
+    int flag;
+} merge_part_t;
+
+static void merge_part(void *arg)
+{
+    const merge_part_t *m = arg;
+    *m->left = merge_runs(*m->left, *m->right, m->flag);
+}
+
+static void parallel_sort(struct list_head *head, bool descend, int nparts)
+{
+    sort_part_t parts[Q_SORT_MAX_THREADS];
+    merge_part_t merges[Q_SORT_MAX_THREADS];
+    task_t tasks[Q_SORT_MAX_THREADS];
+    int size = q_size(head);
+
+    /* The pool works on this frame, so a time limit must not unwind it
+     * before the list is whole again.  SIGALRM stays pending until then.
+     */
+    sigset_t alrm, old;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &old);
+
+    for (int i = 0; i < nparts; i++) {
+        sort_part_t *part = &parts[i];
+        int len = (int) ((long) (i + 1) * size / nparts -
+                         (long) i * size / nparts);
+
+        INIT_LIST_HEAD(&part->q.head);
+        part->q.size = len;
+        part->q.pool = NULL;
+        part->descend = descend;
+        if (i == nparts - 1) {
+            list_splice_init(head, &part->q.head);
+        } else {
+            struct list_head *last = head;
+            while (len--)
+                last = last->next;
+            list_cut_position(&part->q.head, head, last);
+        }
+        tasks[i].fn = sort_part;
+        tasks[i].arg = part;
+    }
+
+    workers_grow(nparts);
+    workers_run(tasks, nparts);
+
+    for (int step = 1; step < nparts; step <<= 1) {
+        int n = 0;
+        for (int i = 0; i + step < nparts; i += step << 1, n++) {
+            merges[n].left = &parts[i].run;
+            merges[n].right = &parts[i + step].run;
+            merges[n].flag = descend ? -1 : 1;
+            tasks[n].fn = merge_part;
+            tasks[n].arg = &merges[n];
+        }
+        workers_run(tasks, n);
+    }
+
+    head->next = parts[0].run.head;
+    parts[0].run.head->prev = head;
+    rebuild_list(head);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
+
+    int nparts = q_size(head) / PARALLEL_MIN_PART;
+    if (nparts > q_sort_threads)
+        nparts = q_sort_threads;
+    if (nparts > 1)
+        parallel_sort(head, descend, nparts);
+    else
+        sort_serial(head, descend);
+}
+
 /* Remove every node which has a node with a strictly less value anywhere to
  * the right side of it */
 int q_ascend(struct list_head *head)
@@ -432,6 +1282,71 @@ int q_descend(struct list_head *head)
     return monotonic_from_right(head, NON_DECREASING);
 }
 
+/* Queues merged at once by q_merge(), longer chains are merged in groups */
+#define MERGE_FANIN 1024
+
+/* A queue still to be merged and its position within its group */
+typedef struct {
+    struct list_head *q;
+    int idx;
+} merge_src_t;
+
+/* Whether the first element of @a goes before the first element of @b */
+static inline bool src_before(const merge_src_t *a,
+                              const merge_src_t *b,
+                              int flag)
+{
+    int cmp = flag * q_cmp(list_first_entry(a->q, element_t, list),
+                           list_first_entry(b->q, element_t, list));
+    return cmp < 0 || (!cmp && a->idx < b->idx);
+}
+
+static void heap_sift_down(merge_src_t *heap, int n, int i, int flag)
+{
+    merge_src_t src = heap[i];
+
+    for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && src_before(&heap[child + 1], &heap[child], flag))
+            child++;
+        if (!src_before(&heap[child], &src, flag))
+            break;
+        heap[i] = heap[child];
+    }
+    heap[i] = src;
+}
+
+/* Merge the @n sorted queues in @heap into the first one through a binary
+ * min-heap keyed by their first elements. Ties go to the queue which comes
+ * first, which keeps the merge stable. The others are left empty.
+ */
+static void merge_group(merge_src_t *heap, int n, int flag)
+{
+    struct list_head *dst = heap[0].q;
+    LIST_HEAD(out);
+    int size = 0, live = 0;
+
+    for (int i = 0; i < n; i++) {
+        size += q_size(heap[i].q);
+        q_to_queue(heap[i].q)->size = 0;
+        if (!list_empty(heap[i].q))
+            heap[live++] = heap[i];
+    }
+    for (int i = live / 2 - 1; i >= 0; i--)
+        heap_sift_down(heap, live, i, flag);
+
+    while (live > 1) {
+        list_move_tail(heap[0].q->next, &out);
+        if (list_empty(heap[0].q))
+            heap[0] = heap[--live];
+        heap_sift_down(heap, live, 0, flag);
+    }
+    if (live)
+        list_splice_tail_init(heap[0].q, &out);
+
+    list_splice(&out, dst);
+    q_to_queue(dst)->size = size;
+}
+
 /* Merge all the queues into one sorted queue, which is in ascending/descending
  * order */
 int q_merge(struct list_head *head, bool descend)
@@ -440,24 +1355,32 @@ int q_merge(struct list_head *head, bool descend)
     if (!head || list_empty(head))
         return 0;
 
+    merge_src_t heap[MERGE_FANIN];
     queue_contex_t *qctx;
-    struct list_head *first_q = NULL;
-    list_for_each_entry(qctx, head, chain) {
-        if (first_q)
-            list_splice_tail_init(qctx->q, first_q);
-        else
-            first_q = qctx->q;
-    }
+    int flag = descend ? -1 : 1;
+    int k = 0;
 
-    int size = q_size(first_q);
+    list_for_each_entry(qctx, head, chain)
+        k++;
 
-    /* The queues guaranteed sorted before calling this function, if the chain
-     * is singular, no need to sort the first queue again.
+    /* Every pass merges groups of MERGE_FANIN queues, @stride apart, into the
+     * first queue of each group, which takes part in the next pass.
      */
-    if (list_is_singular(head))
-        return size;
-
-    q_sort(first_q, descend);
+    for (long stride = 1; stride < k; stride *= MERGE_FANIN) {
+        int i = 0, n = 0;
+        list_for_each_entry(qctx, head, chain) {
+            if (i++ % stride)
+                continue;
+            heap[n].q = qctx->q;
+            heap[n].idx = n;
+            if (++n == MERGE_FANIN) {
+                merge_group(heap, n, flag);
+                n = 0;
+            }
+        }
+        if (n > 1)
+            merge_group(heap, n, flag);
+    }
 
-    return size;
+    return q_size(list_first_entry(head, queue_contex_t, chain)->q);
 }
@@ -18,13 +18,42 @@
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
  *
- * @value needs to be explicitly allocated and freed
+ * @value needs to be explicitly allocated and freed. Short strings are kept
+ * inline, right after @list in the same block as the element, while longer
+ * ones live in a separate allocation. Either way, only q_release_element()
+ * knows how to release an element created by the queue.
  */
 typedef struct {
     char *value;
     struct list_head list;
 } element_t;
 
+/**
+ * queue_t - Header of a queue
+ * @head: list head handed out by q_new(), must stay in first position
+ * @size: number of elements in the queue, kept up to date by every operation
+ * @pool: slab pool of the queue, NULL if q_use_pool was off at q_new()
+ *
+ * The operations below still take and return the embedded list head, so that
+ * existing callers keep working. Use q_to_queue() to reach the header.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    struct __pool *pool;
+} queue_t;
+
+/**
+ * q_to_queue() - Get the header of the queue owning a list head
+ * @head: list head returned by q_new()
+ *
+ * Return: the queue header, NULL if @head is NULL
+ */
+static inline queue_t *q_to_queue(struct list_head *head)
+{
+    return head ? container_of(head, queue_t, head) : NULL;
+}
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -39,6 +68,41 @@ typedef struct {
     int id;
 } queue_contex_t;
 
+/**
+ * q_use_pool - Whether newly created queues own a slab pool
+ *
+ * When non-zero, q_new() attaches a slab pool to the queue. Elements and short
+ * strings inserted into that queue are then carved from slabs obtained with a
+ * single malloc() each, instead of two malloc() calls per insertion. Queues
+ * that already exist keep the mode they were created with.
+ */
+extern int q_use_pool;
+
+/* Algorithms q_sort() can use */
+typedef enum {
+    SORT_MERGE,       /* Bottom-up merge sort calling strcmp() */
+    SORT_MERGE_KEYED, /* Merge sort on cached 8-byte keys, with prefetching */
+    SORT_NATURAL,     /* Stable natural merge sort with galloping (Timsort) */
+    SORT_RADIX,       /* MSD radix sort over the bytes of the strings */
+    N_SORT_ALGO,
+} sort_algo_t;
+
+/**
+ * q_sort_algo - Algorithm used by q_sort(), one of sort_algo_t
+ */
+extern int q_sort_algo;
+
+/* Upper bound of q_sort_threads */
+#define Q_SORT_MAX_THREADS 64
+
+/**
+ * q_sort_threads - Number of threads q_sort() may use
+ *
+ * Large queues are cut into up to this many parts, sorted in parallel and
+ * merged back. The result is the same as with a single thread.
+ */
+extern int q_sort_threads;
+
 /* Operations on queue */
 
 /**
@@ -112,18 +176,19 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  * q_release_element() - Release the element
  * @e: element would be released
  *
+ * The element and its string are handed back to wherever they came from,
+ * i.e. the heap or the slab pool of the queue that created them.
+ *
  * This function is intended for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
 
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The size is read from the queue header, in constant time.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
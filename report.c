@@ -29,6 +29,19 @@ static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
 
+/* Output is block buffered, and flushed at command boundaries or before
+ * writing past stdio
+ */
+void report_flush()
+{
+    if (verbfile)
+        fflush(verbfile);
+    if (errfile && errfile != verbfile)
+        fflush(errfile);
+    if (logfile)
+        fflush(logfile);
+}
+
 /* Default fatal function */
 static void default_fatal_fun()
 {
@@ -75,7 +88,6 @@ void report_event(message_t msg, char *fmt, ...)
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
     fprintf(errfile, "\n");
-    fflush(errfile);
     va_end(ap);
 
     if (logfile) {
@@ -83,12 +95,11 @@ void report_event(message_t msg, char *fmt, ...)
         fprintf(logfile, "Error: ");
         vfprintf(logfile, fmt, ap);
         fprintf(logfile, "\n");
-        fflush(logfile);
         va_end(ap);
-        fclose(logfile);
     }
 
     if (fatal) {
+        report_flush();
         if (fatal_fun)
             fatal_fun();
         exit(1);
@@ -108,14 +119,12 @@ void report(int level, char *fmt, ...)
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
         fprintf(verbfile, "\n");
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
             fprintf(logfile, "\n");
-            fflush(logfile);
             va_end(ap);
         }
         va_start(ap, fmt);
@@ -140,13 +149,11 @@ void report_noreturn(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fflush(logfile);
             va_end(ap);
         }
         va_start(ap, fmt);
@@ -163,6 +170,7 @@ void report_noreturn(int level, char *fmt, ...)
 /* Need to be able to print without using malloc */
 static void fail_fun(const char *format, const char *msg)
 {
+    report_flush();
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
@@ -304,11 +312,20 @@ void init_time(double *timep)
     (void) delta_time(timep);
 }
 
+uint64_t time_ns()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = 1.0E-9 * time_ns();
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
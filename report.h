@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -14,6 +15,9 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL, N_MSG } message_t;
 
 bool set_logfile(const char *file_name);
 
+/* Write out buffered reports */
+void report_flush();
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -44,6 +48,9 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/* Nanoseconds from a monotonic clock, not slewed by time adjustments */
+uint64_t time_ns();
+
 /* Time counted as fp number in seconds */
 void init_time(double *timep);
 
@@ -0,0 +1,157 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "harness.h"
+#include "ring.h"
+
+#define CACHE_LINE 64
+
+/* @tail is written by producers and @head by the consumer, keep them on their
+ * own cache lines, away from the read-mostly fields.
+ *
+ * The slot at position p (modulo the capacity) is ready to be written when its
+ * sequence number equals p, and ready to be read when it equals p + 1.
+ */
+struct __ring {
+    _Atomic size_t tail;
+    char pad_tail[CACHE_LINE - sizeof(size_t)];
+    _Atomic size_t head;
+    char pad_head[CACHE_LINE - sizeof(size_t)];
+    size_t mask;
+    size_t slot_size;
+    bool multi_producer;
+    _Atomic size_t *seq;
+    char *slab;
+};
+
+static inline char *ring_slot(const ring_t *r, size_t pos)
+{
+    return r->slab + (pos & r->mask) * r->slot_size;
+}
+
+static void copy_out(char *sp, size_t bufsize, const char *s)
+{
+    if (sp && bufsize) {
+        strncpy(sp, s, bufsize - 1);
+        sp[bufsize - 1] = '\0';
+    }
+}
+
+ring_t *ring_new(size_t capacity, size_t slot_size, bool multi_producer)
+{
+    if (!capacity || capacity > RING_MAX_CAPACITY || !slot_size ||
+        slot_size > RING_MAX_SLOT)
+        return NULL;
+
+    size_t cap = 1;
+    while (cap < capacity)
+        cap <<= 1;
+
+    /* The header, sequence numbers and string slab share one block */
+    ring_t *r = malloc(sizeof(ring_t) + cap * sizeof(size_t) +
+                       cap * slot_size);
+    if (!r)
+        return NULL;
+
+    r->mask = cap - 1;
+    r->slot_size = slot_size;
+    r->multi_producer = multi_producer;
+    r->seq = (_Atomic size_t *) (r + 1);
+    r->slab = (char *) (r->seq + cap);
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&r->seq[i], i);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return r;
+}
+
+void ring_free(ring_t *r)
+{
+    free(r);
+}
+
+bool ring_insert_tail(ring_t *r, const char *s)
+{
+    if (!r)
+        return false;
+
+    size_t len = strnlen(s, r->slot_size);
+    if (len == r->slot_size)
+        return false;
+
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (;;) {
+        size_t seq = atomic_load_explicit(&r->seq[pos & r->mask],
+                                          memory_order_acquire);
+        intptr_t dif = (intptr_t) (seq - pos);
+        if (dif < 0)
+            return false; /* Full, the consumer has not freed this slot yet */
+
+        if (dif > 0) {
+            /* Another producer took this slot */
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        } else if (!r->multi_producer) {
+            atomic_store_explicit(&r->tail, pos + 1, memory_order_relaxed);
+            break;
+        } else if (atomic_compare_exchange_weak_explicit(
+                       &r->tail, &pos, pos + 1, memory_order_relaxed,
+                       memory_order_relaxed)) {
+            break;
+        }
+    }
+
+    memcpy(ring_slot(r, pos), s, len + 1);
+    atomic_store_explicit(&r->seq[pos & r->mask], pos + 1,
+                          memory_order_release);
+    return true;
+}
+
+bool ring_remove_head(ring_t *r, char *sp, size_t bufsize)
+{
+    if (!r)
+        return false;
+
+    size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    _Atomic size_t *seq = &r->seq[pos & r->mask];
+    if (atomic_load_explicit(seq, memory_order_acquire) != pos + 1)
+        return false;
+
+    copy_out(sp, bufsize, ring_slot(r, pos));
+    /* Hand the slot over to the producer one lap ahead */
+    atomic_store_explicit(seq, pos + r->mask + 1, memory_order_release);
+    atomic_store_explicit(&r->head, pos + 1, memory_order_relaxed);
+    return true;
+}
+
+bool ring_remove_tail(ring_t *r, char *sp, size_t bufsize)
+{
+    if (!r)
+        return false;
+
+    size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (pos == atomic_load_explicit(&r->head, memory_order_relaxed))
+        return false;
+
+    pos--;
+    copy_out(sp, bufsize, ring_slot(r, pos));
+    /* Make the slot writable again at the same position */
+    atomic_store_explicit(&r->seq[pos & r->mask], pos, memory_order_release);
+    atomic_store_explicit(&r->tail, pos, memory_order_relaxed);
+    return true;
+}
+
+size_t ring_size(ring_t *r)
+{
+    if (!r)
+        return 0;
+
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    return tail - head;
+}
+
+size_t ring_capacity(const ring_t *r)
+{
+    return r ? r->mask + 1 : 0;
+}
@@ -0,0 +1,91 @@
+#ifndef LAB0_RING_H
+#define LAB0_RING_H
+
+/* This program implements a bounded FIFO queue of strings on top of a ring
+ * buffer. All memory, including a slab holding a fixed-size slot for every
+ * string, is allocated by ring_new(), so the other operations never allocate.
+ *
+ * Every slot carries a sequence number telling whether it is ready to be
+ * written or read, as in the bounded queue of Dmitry Vyukov. One consumer may
+ * run concurrently with one producer, or with any number of producers if the
+ * ring was created for multiple ones.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Upper bounds of the arguments of ring_new() */
+#define RING_MAX_CAPACITY (1UL << 24)
+#define RING_MAX_SLOT 4096
+
+typedef struct __ring ring_t;
+
+/**
+ * ring_new() - Create an empty ring buffer queue
+ * @capacity: number of strings the ring holds, rounded up to a power of 2
+ * @slot_size: bytes reserved for each string, null terminator included
+ * @multi_producer: whether several threads may insert at the same time
+ *
+ * Return: NULL for allocation failed or invalid sizes
+ */
+ring_t *ring_new(size_t capacity, size_t slot_size, bool multi_producer);
+
+/**
+ * ring_free() - Free all storage used by ring buffer queue
+ * @r: ring to be freed, no other thread may be using it
+ */
+void ring_free(ring_t *r);
+
+/**
+ * ring_insert_tail() - Insert an element at the tail, like q_insert_tail()
+ * @r: ring buffer queue
+ * @s: string would be inserted
+ *
+ * Return: true for success, false if the ring is NULL or full, or @s does not
+ * fit in a slot
+ */
+bool ring_insert_tail(ring_t *r, const char *s);
+
+/**
+ * ring_remove_head() - Remove the element at the head, like q_remove_head()
+ * @r: ring buffer queue
+ * @sp: string would be inserted
+ * @bufsize: size of the string
+ *
+ * Only the consumer thread may call this function.
+ *
+ * Return: true if an element was removed, false if the ring is NULL or empty
+ */
+bool ring_remove_head(ring_t *r, char *sp, size_t bufsize);
+
+/**
+ * ring_remove_tail() - Remove the element at the tail, like q_remove_tail()
+ * @r: ring buffer queue
+ * @sp: string would be inserted
+ * @bufsize: size of the string
+ *
+ * Only the consumer thread may call this function, and since the slot goes
+ * back to the producers, no thread may be inserting at the same time.
+ *
+ * Return: true if an element was removed, false if the ring is NULL or empty
+ */
+bool ring_remove_tail(ring_t *r, char *sp, size_t bufsize);
+
+/**
+ * ring_size() - Return the number of elements in the ring
+ * @r: ring buffer queue
+ *
+ * Return: the number of elements, 0 if @r is NULL. It is only a snapshot while
+ * other threads operate on the ring.
+ */
+size_t ring_size(ring_t *r);
+
+/**
+ * ring_capacity() - Return the number of elements the ring can hold
+ * @r: ring buffer queue
+ *
+ * Return: the capacity, 0 if @r is NULL
+ */
+size_t ring_capacity(const ring_t *r);
+
+#endif /* LAB0_RING_H */
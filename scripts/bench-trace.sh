@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+
+# Time how fast qtest reads a generated trace of comment lines, from a mapped
+# file and through a pipe.
+# Usage: scripts/bench-trace.sh [-b commit] [lines] [qtest ...]
+# With -b, qtest is also built from that commit, to compare with its reader.
+
+source "$(dirname "$0")/common.sh"
+
+BASE=
+if [ "$1" = "-b" ]; then
+  BASE="$2"
+  shift 2
+fi
+LINES=${1:-10000000}
+shift
+[ $# -gt 0 ] || set -- ./qtest
+
+TMP=$(mktemp -d /tmp/qtest.XXXXXX)
+trap 'git worktree remove --force "$TMP/base" 2>/dev/null; rm -rf "$TMP"' EXIT
+TRACE="$TMP/bench.cmd"
+
+if [ -n "$BASE" ]; then
+  git worktree add --detach "$TMP/base" "$BASE" >/dev/null 2>&1 ||
+    throw "Could not check out %s" "$BASE"
+  make -C "$TMP/base" qtest >/dev/null || throw "Could not build %s" "$BASE"
+  set -- "$@" "$TMP/base/qtest"
+fi
+
+awk -v n="$LINES" 'BEGIN {
+  for (i = 0; i < n; i++)
+    printf "# line %d of the generated benchmark trace\n", i
+}' >"$TRACE" || throw "Could not generate %s" "$TRACE"
+printf "%d lines, %d bytes\n" "$LINES" "$(wc -c <"$TRACE")"
+
+# Usage: LABEL COMMAND...
+run() {
+  local label="$1" start end ms
+  shift
+  start=$(date +%s%N)
+  "$@" >/dev/null || throw "%s failed" "$label"
+  end=$(date +%s%N)
+  ms=$(((end - start) / 1000000))
+  printf "%-40s %6d ms %10d lines/sec\n" "$label" "$ms" \
+    $((LINES * 1000 / (ms > 0 ? ms : 1)))
+}
+
+for qtest in "$@"; do
+  run "$qtest, mapped" "$qtest" -v 0 -f "$TRACE"
+  run "$qtest, pipe" sh -c 'cat "$1" | "$2" -v 0 -f /dev/stdin' sh \
+    "$TRACE" "$qtest"
+done
@@ -0,0 +1,20 @@
+#!/usr/bin/env bash
+
+# Check that traces of erroneous commands fail, and print every message listed
+# on their "# expect: " lines.
+
+source "$(dirname "$0")/common.sh"
+set_colors
+
+QTEST=${QTEST:-./qtest}
+
+for trace in "$@"; do
+  name=$(basename "$trace" .cmd)
+  if out=$("$QTEST" -v 1 -f "$trace" 2>&1); then
+    throw "%s did not fail" "$trace"
+  fi
+  while IFS= read -r msg; do
+    grep -qxF -- "$msg" <<<"$out" || throw "%s did not print '%s'" "$trace" "$msg"
+  done < <(sed -n 's/^# expect: //p' "$trace")
+  printf -- "---\t%s\tok\n" "$name"
+done
@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+
+# Check that replaying a compiled trace prints the same as running its source,
+# but for the spacing of echoed lines, which is not compiled, and for timings.
+# Traces whose output differs between two runs of their source, such as those
+# with random strings or timings, are skipped.
+
+source "$(dirname "$0")/common.sh"
+set_colors
+
+QTEST=${QTEST:-./qtest}
+TMP=$(mktemp -d /tmp/qtest.XXXXXX)
+trap 'rm -rf "$TMP"' EXIT
+
+# Drop what a compiled trace is not expected to reproduce
+normalize() {
+  tr -s ' ' <"$1" | grep -v '^Delta time = '
+}
+
+checked=0
+for trace in "$@"; do
+  name=$(basename "$trace" .cmd)
+  "$QTEST" -v 3 -f "$trace" >"$TMP/a" 2>&1
+  "$QTEST" -v 3 -f "$trace" >"$TMP/b" 2>&1
+  if ! cmp -s "$TMP/a" "$TMP/b"; then
+    printf -- "${YELLOW}---\t%s\tskipped, output varies${NC}\n" "$name"
+    continue
+  fi
+  "$QTEST" -c "$trace" -o "$TMP/$name.qbc" || throw "Could not compile %s" "$trace"
+  "$QTEST" -v 3 -f "$TMP/$name.qbc" >"$TMP/b" 2>&1
+  if ! diff -u <(normalize "$TMP/a") <(normalize "$TMP/b"); then
+    throw "Replaying %s compiled differs from its source" "$trace"
+  fi
+  printf -- "---\t%s\tok\n" "$name"
+  checked=$((checked + 1))
+done
+
+[ "$checked" -gt 0 ] || throw "No trace could be checked"
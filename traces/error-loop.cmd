@@ -0,0 +1,11 @@
+# Errors of 'repeat', 'loop' and 'end'
+# expect: end without loop
+# expect: Cannot repeat loop
+# expect: loop takes a non-negative number of iterations
+# expect: ERROR: loop without end
+new
+end
+repeat 2 loop 2
+loop x
+loop 2
+it a
@@ -0,0 +1,62 @@
+# Test of 'q_merge' with duplicates across queues and thousands of sorted queues
+option fail 0
+option malloc 0
+# Each "kiwi" and "plum" comes from a different queue, and the merge checks
+# that duplicates keep the order of their queues
+new
+it apple
+it kiwi
+it plum
+new
+it banana
+it kiwi
+it kiwi
+new
+it kiwi
+it plum
+it plum
+new
+it apple
+it cherry
+merge
+rh apple
+rh apple
+rh banana
+rh cherry
+rh kiwi
+rh kiwi
+rh kiwi
+rh kiwi
+rh plum
+rh plum
+rh plum
+free
+option descend 1
+new
+it z
+it m
+it a
+new
+it y
+it m
+it a
+new
+it x
+it m
+it a
+merge
+rh z
+rh y
+rh x
+rh m
+rh m
+rh m
+free
+option descend 0
+loop 2500
+new
+ih RAND 3
+sort
+end
+merge
+free
@@ -0,0 +1,10 @@
+# Test performance of 'q_free' with one million elements, each free checked in cautious mode: 'q_new', 'q_insert_head', 'q_insert_tail', and 'q_free'
+option fail 0
+option malloc 0
+new
+ih RAND 500000
+it RAND 500000
+free
+new
+ih dolphin 1000000
+free
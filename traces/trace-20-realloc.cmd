@@ -0,0 +1,13 @@
+# Test of 'test_realloc': growth within and beyond the size class, shrinking, failure injection and guard pages
+option fail 0
+option malloc 0
+# 10 and 16 share a class, 40 and 48 too, 100 and 112 too
+realloc 10 16 40 48 100 112 20 200
+option failnth 2
+realloc 10 16 40
+option failnth 3
+realloc 100 20 300 24
+option failnth 0
+option guardpages 1
+realloc 10 16 8 4096 100
+option guardpages 0
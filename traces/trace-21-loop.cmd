@@ -0,0 +1,34 @@
+# Test of 'repeat', nested 'loop' ... 'end' blocks and 'time loop'
+option fail 0
+option malloc 0
+new
+repeat 3 it a
+# Each pass appends b, then prepends c three times and removes one
+loop 2
+it b
+loop 3
+ih c
+end
+rh c
+end
+repeat 4 rh c
+repeat 3 rh a
+repeat 2 rh b
+time loop 2
+repeat 10 it d
+end
+repeat 20 rh d
+loop 0
+it never
+end
+loop 2
+time loop 3
+it e
+end
+size
+end
+repeat 6 rh e
+# Nothing is left before z
+it z
+rh z
+free